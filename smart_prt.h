@@ -2,39 +2,351 @@
 #pragma once
 
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <tuple>
 #include <type_traits>
+#include <vector>
+#ifdef SP_CHECK_BORROWS
+#include <cassert>
+#endif
+#if defined(SP_ENABLE_STATS) || defined(SP_ENABLE_REGISTRY)
+#include <string>
+#include <typeinfo>
+#endif
 
 namespace utils
 {
 	namespace sp
 	{
+//-------------------instrumentation---------------------------------
+		// define SP_ENABLE_STATS to count control block traffic per pointee type and in
+		// total; without it the hooks are empty and control blocks carry no extra field
+#ifdef SP_ENABLE_STATS
+		struct sp_stats_record
+		{
+			// links the record into the registry read by sp_stats_collect
+			explicit sp_stats_record(const char* type_name) noexcept;
+
+			void add_block(std::size_t bytes) noexcept;
+			void remove_block(std::size_t bytes) noexcept;
+
+			const char* name;
+			std::atomic<std::uint64_t> blocks_created{ 0 };
+			std::atomic<std::uint64_t> blocks_destroyed{ 0 };
+			// strong and weak count changes, including releases served without an atomic
+			std::atomic<std::uint64_t> increments{ 0 };
+			std::atomic<std::uint64_t> decrements{ 0 };
+			std::atomic<std::uint64_t> locks_succeeded{ 0 };
+			std::atomic<std::uint64_t> locks_failed{ 0 };
+			std::atomic<std::uint64_t> unique_created{ 0 };
+			std::atomic<std::uint64_t> unique_bytes{ 0 };
+			// control blocks, and the object when it shares their allocation
+			std::atomic<std::uint64_t> bytes_live{ 0 };
+			std::atomic<std::uint64_t> bytes_peak{ 0 };
+			sp_stats_record* next;
+		};
+
+		sp_stats_record& sp_stats_total() noexcept;
+
+		template<typename T>
+		sp_stats_record& sp_stats_of() noexcept
+		{
+			static sp_stats_record rec(typeid(T).name());
+			return rec;
+		}
+
+		struct sp_stats_snapshot
+		{
+			std::string name;
+			std::uint64_t blocks_created;
+			std::uint64_t blocks_destroyed;
+			std::uint64_t blocks_live;
+			std::uint64_t increments;
+			std::uint64_t decrements;
+			std::uint64_t locks_succeeded;
+			std::uint64_t locks_failed;
+			std::uint64_t unique_created;
+			std::uint64_t unique_bytes;
+			std::uint64_t bytes_live;
+			std::uint64_t bytes_peak;
+		};
+
+		// the total first, then every type that has been counted so far
+		std::vector<sp_stats_snapshot> sp_stats_collect();
+		std::string sp_stats_dump_text();
+		std::string sp_stats_dump_json();
+#endif
+
+//-------------------control block registry---------------------------------
+		// define SP_ENABLE_REGISTRY to link every live sp_counted_base into a registry
+		// sharded by creating thread, so blocks kept alive by forgotten copies can be found
+		// in a running process: take a checkpoint, run the workload, then report what was
+		// created after the checkpoint and is still alive.
+#ifdef SP_ENABLE_REGISTRY
+		class sp_counted_base;
+
+		struct sp_registry_node
+		{
+			sp_registry_node* prev;
+			sp_registry_node* next;
+			sp_counted_base const* block;
+			const char* type_name;
+			std::size_t bytes;
+			std::int64_t created_ns;
+			unsigned shard;
+		};
+
+		struct sp_registry_block
+		{
+			std::string type_name;
+			std::size_t bytes;
+			double age_seconds;
+			long use_count;
+			long weak_count;
+			// biased or sharded block: the owners are counted inside the block, and
+			// use_count only says whether any are left (1) or not (0)
+			bool delegated;
+		};
+
+		// an opaque point in time for sp_registry_collect / sp_registry_report
+		std::int64_t sp_registry_checkpoint() noexcept;
+		// live blocks created after the checkpoint (all of them for 0)
+		std::vector<sp_registry_block> sp_registry_collect(std::int64_t since = 0);
+		// the same blocks grouped by type, largest total size first
+		std::string sp_registry_report(std::int64_t since = 0);
+#endif
+
 		class sp_counted_base
 		{
 		public:
 			sp_counted_base();
+#if defined(SP_ENABLE_STATS) || defined(SP_ENABLE_REGISTRY)
+			virtual ~sp_counted_base();
+#else
 			virtual ~sp_counted_base() = default;
+#endif
+#ifdef SP_ENABLE_STATS
+			// attribute this block to rec; impl constructors call it through sp_stats_bind
+			void stats_bind(sp_stats_record& rec, std::size_t bytes) noexcept;
+#endif
+#ifdef SP_ENABLE_REGISTRY
+			// name the registry entry; impl constructors call it through sp_stats_bind
+			void registry_describe(const char* type_name, std::size_t bytes) noexcept;
+#endif
 			virtual void dispose() = 0;
 			virtual void destroy() = 0;
+			// last owner and no weak_ptr left: one indirect call instead of two,
+			// impl blocks override it so dispose/destroy are bound statically
+			virtual void dispose_destroy()
+			{
+				dispose();
+				destroy();
+			}
 		public:
 			void add_ref_copy();
-			void add_ref_lock();
+			// n new owners with one atomic add
+			void add_ref_copy(long n);
+			// increment the use count unless it is already zero; false if the object is
+			// gone. One inline CAS for the common case, retries and delegated blocks go
+			// through add_ref_lock_slow.
+			bool add_ref_lock()
+			{
+				std::uint64_t cur = m_counts.load(std::memory_order_relaxed);
+				if ((cur & delegated_bit) == 0 && (cur & use_mask) != 0 &&
+					m_counts.compare_exchange_weak(cur, cur + use_one, std::memory_order_acq_rel, std::memory_order_relaxed))
+				{
+#ifdef SP_ENABLE_STATS
+					stats_add(&sp_stats_record::locks_succeeded);
+					stats_add(&sp_stats_record::increments);
+#endif
+					return true;
+				}
+				return add_ref_lock_slow();
+			}
 			void weak_add_ref();
 			void weak_release();
 			void release();
+			// drop n owners with one atomic subtract
+			void release(long n);
 			long use_count() const;
 		protected:
+			// Blocks that keep their strong count elsewhere (biased counting) call
+			// mark_delegated() in their constructor. The use half of m_counts then only
+			// says "alive" (1) or "gone" (0), and strong-count traffic goes through the
+			// delegated_* hooks; ordinary blocks pay one plain load to find out.
+			void mark_delegated() noexcept;
+			// the delegated count reached zero: drop the "alive" unit, dispose, weak_release
+			void release_last();
+
+			virtual void delegated_add_ref() {}
+			// true when that was the last strong reference
+			virtual bool delegated_release() { return true; }
+			virtual bool delegated_add_ref_lock() { return true; }
+			virtual long delegated_use_count() const { return 1; }
 		private:
-			std::atomic<long> m_use_count;
-			std::atomic<long> m_weak_count;
+			// use count in the low 31 bits, weak count in the high 32 bits; the weak
+			// count holds one extra reference on behalf of all strong owners
+			static constexpr std::uint64_t use_one = 1;
+			static constexpr std::uint64_t weak_one = std::uint64_t(1) << 32;
+			static constexpr std::uint64_t delegated_bit = std::uint64_t(1) << 31;
+			static constexpr std::uint64_t use_mask = delegated_bit - 1;
+
+			bool add_ref_lock_slow();
+
+			std::atomic<std::uint64_t> m_counts;
+#ifdef SP_ENABLE_STATS
+			void stats_add(std::atomic<std::uint64_t> sp_stats_record::* counter) noexcept;
+
+			sp_stats_record* m_stats;
+			std::size_t m_stats_bytes;
+#endif
+#ifdef SP_ENABLE_REGISTRY
+			friend std::vector<sp_registry_block> sp_registry_collect(std::int64_t since);
+
+			sp_registry_node m_registry;
+#endif
 		};//sp_counted_base
+
+		// local_sp_counted_base: same protocol with plain counters, for owners that
+		// never leave one thread (local_shared_ptr / local_weak_ptr)
+		class local_sp_counted_base
+		{
+		public:
+			local_sp_counted_base();
+			virtual ~local_sp_counted_base() = default;
+			virtual void dispose() = 0;
+			virtual void destroy() = 0;
+			// last owner and no weak_ptr left: one indirect call instead of two,
+			// impl blocks override it so dispose/destroy are bound statically
+			virtual void dispose_destroy()
+			{
+				dispose();
+				destroy();
+			}
+		public:
+			void add_ref_copy();
+			void add_ref_lock();
+			void weak_add_ref();
+			void weak_release();
+			void release();
+			long use_count() const;
+		private:
+			long m_use_count;
+			long m_weak_count;
+		};//local_sp_counted_base
+
+		// instrumentation hooks, empty without SP_ENABLE_STATS / SP_ENABLE_REGISTRY;
+		// local blocks are neither counted nor registered
+		template<typename T>
+		inline void sp_stats_bind(sp_counted_base* pi, std::size_t bytes) noexcept
+		{
+#ifdef SP_ENABLE_STATS
+			pi->stats_bind(sp_stats_of<T>(), bytes);
+#endif
+#ifdef SP_ENABLE_REGISTRY
+			pi->registry_describe(typeid(T).name(), bytes);
+#endif
+			(void)pi;
+			(void)bytes;
+		}
+
+		template<typename T>
+		inline void sp_stats_bind(local_sp_counted_base*, std::size_t) noexcept
+		{
+		}
+
+		template<typename T>
+		inline void sp_stats_unique_created(std::size_t bytes) noexcept
+		{
+#ifdef SP_ENABLE_STATS
+			for (sp_stats_record* rec : { &sp_stats_of<T>(), &sp_stats_total() })
+			{
+				rec->unique_created.fetch_add(1, std::memory_order_relaxed);
+				rec->unique_bytes.fetch_add(bytes, std::memory_order_relaxed);
+			}
+#else
+			(void)bytes;
+#endif
+		}
+//-----------------------------------------------------------------
+		constexpr std::size_t sp_cache_line_size = 64;
+
+		// sp_node_heap: cache-line aligned memory whose pages prefer one NUMA node.
+		// Blocks up to max_size come from per-node chunks and go back to per-node free
+		// lists; larger ones are mapped on their own. Where the system has no NUMA
+		// support the placement request is dropped and it is an ordinary heap.
+		class sp_node_heap
+		{
+		public:
+			static constexpr int max_nodes = 64;
+			static constexpr std::size_t max_size = 4096;
+			static constexpr std::size_t chunk_size = std::size_t(2) * 1024 * 1024;
+
+			// node of the CPU the calling thread is running on
+			static int current_node() noexcept;
+			static void* allocate(std::size_t size, int node);
+			static void deallocate(void* p, std::size_t size, int node) noexcept;
+		};
+
+		// sp_counted_pool: thread-caching slab pool for small control blocks.
+		// Each thread keeps per-size-class free lists, surplus blocks (for example
+		// blocks freed by a thread other than the one that allocated them) go to a
+		// global depot. Slabs are never returned to the system.
+		class sp_counted_pool
+		{
+		public:
+			static constexpr std::size_t granularity = 16;
+			static constexpr std::size_t max_size = 128;
+
+			static void* allocate(std::size_t size);
+			static void deallocate(void* p, std::size_t size) noexcept;
+		};
+
+		// define SP_USE_COUNTED_POOL to serve the control blocks of shared_ptr(Y*)
+		// and shared_ptr(Y*, D) from sp_counted_pool instead of the global heap
+#ifdef SP_USE_COUNTED_POOL
+		struct sp_counted_pooled
+		{
+			static void* operator new(std::size_t size)
+			{
+				return sp_counted_pool::allocate(size);
+			}
+
+			static void operator delete(void* p, std::size_t size) noexcept
+			{
+				sp_counted_pool::deallocate(p, size);
+			}
+
+			// over-aligned blocks bypass the pool
+			static void* operator new(std::size_t size, std::align_val_t al)
+			{
+				return ::operator new(size, al);
+			}
+
+			static void operator delete(void* p, std::size_t size, std::align_val_t al) noexcept
+			{
+				::operator delete(p, size, al);
+			}
+		};
+#else
+		struct sp_counted_pooled {};
+#endif
 //-----------------------------------------------------------------
 			//sp_counted_impl_p：default deletor
-		template<typename T>
-		class sp_counted_impl_p :public sp_counted_base
+			// CB selects the counting base (sp_counted_base or local_sp_counted_base)
+		template<typename T, typename CB = sp_counted_base>
+		class sp_counted_impl_p final :public CB, public sp_counted_pooled
 		{
 		public:
-			explicit   sp_counted_impl_p(T* ptr) :m_ptr(ptr) {}
+			explicit   sp_counted_impl_p(T* ptr) :m_ptr(ptr)
+			{
+				sp_stats_bind<T>(this, sizeof(*this));
+			}
 			virtual void dispose() override
 			{
 				delete m_ptr;
@@ -43,6 +355,11 @@ namespace utils
 			{
 				delete this;
 			}
+			virtual void dispose_destroy() override
+			{
+				delete m_ptr;
+				delete this;
+			}
 			T* get() const noexcept
 			{
 				return m_ptr;
@@ -52,11 +369,14 @@ namespace utils
 		};
 		//----------------------------------------------------
 		// define deletor
-		template<typename T, typename D>
-		class sp_counted_impl_pd : public sp_counted_base
+		template<typename T, typename D, typename CB = sp_counted_base>
+		class sp_counted_impl_pd final : public CB, public sp_counted_pooled
 		{
 		public:
-			sp_counted_impl_pd(T* p, D d) : m_ptr(p), deletor(d) {}
+			sp_counted_impl_pd(T* p, D d) : m_ptr(p), deletor(d)
+			{
+				sp_stats_bind<T>(this, sizeof(*this));
+			}
 
 			virtual void dispose() override
 			{
@@ -68,6 +388,51 @@ namespace utils
 				delete this;
 			}
 
+			virtual void dispose_destroy() override
+			{
+				deletor(m_ptr);
+				delete this;
+			}
+
+			T* get() const
+			{
+				return m_ptr;
+			}
+		private:
+			T* m_ptr;
+			D deletor;
+		};
+		//----------------------------------------------------
+		// define deletor and allocator: the block itself lives in memory from A
+		template<typename T, typename D, typename A>
+		class sp_counted_impl_pda final : public sp_counted_base
+		{
+			typedef sp_counted_impl_pda<T, D, A> this_type;
+			typedef typename std::allocator_traits<A>::template rebind_alloc<this_type> block_allocator;
+		public:
+			sp_counted_impl_pda(T* p, D d, A const& a) : m_ptr(p), deletor(std::move(d)), alloc(a)
+			{
+				sp_stats_bind<T>(this, sizeof(*this));
+			}
+
+			virtual void dispose() override
+			{
+				deletor(m_ptr);
+			}
+
+			virtual void destroy() override
+			{
+				block_allocator a2(alloc);
+				this->~this_type();
+				std::allocator_traits<block_allocator>::deallocate(a2, this, 1);
+			}
+
+			virtual void dispose_destroy() override
+			{
+				dispose();
+				destroy();
+			}
+
 			T* get() const
 			{
 				return m_ptr;
@@ -75,11 +440,24 @@ namespace utils
 		private:
 			T* m_ptr;
 			D deletor;
+			A alloc;
+		};
+		// tag for the *_for_overwrite factories: default-initialize instead of value-initialize
+		struct sp_for_overwrite_t
+		{
+			explicit sp_for_overwrite_t() = default;
 		};
+
+		// Specialize to true for types whose objects are written while other threads copy
+		// shared_ptrs to them: make_shared<T> then keeps the counts and the object on
+		// separate cache lines (see make_shared_separate).
+		template<typename T>
+		struct sp_separate_counts : std::false_type {};
+
 		//----------------------------------------------------------
 		// Inline storage implementation（make_shared optimize）
-		template<typename T>
-		class sp_counted_impl_pdi : public sp_counted_base
+		template<typename T, typename CB = sp_counted_base>
+		class sp_counted_impl_pdi final : public CB
 		{
 			//using storage_type = std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type;
 
@@ -89,10 +467,17 @@ namespace utils
 			{
                 #undef new
 				::new (static_cast<void*>(&storage_block)) T(std::forward<Args>(args)...);
+				sp_stats_bind<T>(this, sizeof(*this));
 				//new	(const_cast<void*>(static_cast<const volatile void*>(std::addressof(*storage_))))  T(std::forward<Args>(args)...);
 				//new (&storage_) T(std::forward<Args>(args)...);
 			}
 
+			explicit sp_counted_impl_pdi(sp_for_overwrite_t) : constructed_(true)
+			{
+				::new (static_cast<void*>(&storage_block)) T;
+				sp_stats_bind<T>(this, sizeof(*this));
+			}
+
 			virtual void dispose() override
 			{
 				if (constructed_) 
@@ -107,6 +492,12 @@ namespace utils
 				delete this;
 			}
 
+			virtual void dispose_destroy() override
+			{
+				get()->~T();
+				delete this;
+			}
+
 			T* get() const noexcept
 			{
 				return const_cast<T*>(reinterpret_cast<T const*>(&storage_block));
@@ -116,120 +507,380 @@ namespace utils
 			bool constructed_;
 		};
 
-		namespace 
+		//----------------------------------------------------------
+		// Inline storage with the object on cache lines of its own, so count traffic from
+		// copying threads does not invalidate the lines holding object fields. The whole
+		// block comes from sp_node_heap on the node it was created for.
+		template<typename T>
+		class sp_counted_impl_pdi_separate final : public sp_counted_base
 		{
-			namespace detail
+			static_assert(alignof(T) <= sp_cache_line_size, "sp_node_heap only aligns to a cache line");
+		public:
+			template<typename... Args>
+			static sp_counted_impl_pdi_separate* create(int node, Args&&... args)
 			{
-				template<typename T> struct sp_element { typedef T type; };
-				template<typename T> struct sp_element<T[]> { typedef T type; };
-				template<typename T, std::size_t N> struct sp_element<T[N]> { typedef T type; };
-
-				template<typename T> struct sp_dereference { typedef T& type; };
-				template<> struct sp_dereference<void> { typedef void type; };
-				template<> struct sp_dereference<void const> { typedef void type; };
-				template<> struct sp_dereference<void volatile> { typedef void type; };
-				template<> struct sp_dereference<void const volatile> { typedef void type; };
-
-				//template <class T>
-				//struct default_delete;
+				void* mem = sp_node_heap::allocate(sizeof(sp_counted_impl_pdi_separate), node);
+				try
+				{
+					return ::new (mem) sp_counted_impl_pdi_separate(node, std::forward<Args>(args)...);
+				}
+				catch (...)
+				{
+					sp_node_heap::deallocate(mem, sizeof(sp_counted_impl_pdi_separate), node);
+					throw;
+				}
+			}
 
-				template <class  T>
-				struct default_delete // default deleter for unique_ptr 
-				{ 
-					constexpr default_delete() noexcept = default;
+			virtual void dispose() override
+			{
+				get()->~T();
+			}
 
-					template <class Tt, std::enable_if_t<std::is_convertible_v<Tt*, T*>, int> = 0>
-					default_delete(const default_delete<Tt>&) noexcept {}
+			virtual void destroy() override
+			{
+				int node = m_node;
+				this->~sp_counted_impl_pdi_separate();
+				sp_node_heap::deallocate(this, sizeof(sp_counted_impl_pdi_separate), node);
+			}
 
-					void operator()(T* _Ptr) const noexcept /* strengthened */ 
-					{ // delete a pointer
-						static_assert(0 < sizeof(T), "can't delete an incomplete type");
-						delete _Ptr;
-					}
-				};
+			virtual void dispose_destroy() override
+			{
+				get()->~T();
+				destroy();
+			}
 
-				template <class T>
-				struct default_delete<T[]>  // default deleter for unique_ptr to array of unknown size
-				{ 
-					constexpr default_delete() noexcept = default;
+			T* get() const noexcept
+			{
+				return const_cast<T*>(reinterpret_cast<T const*>(&storage_block));
+			}
+		private:
+			template<typename... Args>
+			explicit sp_counted_impl_pdi_separate(int node, Args&&... args) : m_node(node)
+			{
+				::new (static_cast<void*>(&storage_block)) T(std::forward<Args>(args)...);
+				sp_stats_bind<T>(this, sizeof(*this));
+			}
 
-					template <class Tt, std::enable_if_t<std::is_convertible_v<Tt(*)[], T(*)[]>, int> = 0>
-					default_delete(const default_delete<Tt[]>&) noexcept {}
+			int m_node;
+			// vptr and counts fill the first line; the object starts on the next one, and the
+			// class alignment pads its last line so no neighbouring block shares it
+			alignas(sp_cache_line_size) alignas(T) typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage_block;
+		};
 
-					template <class Tt, std::enable_if_t<std::is_convertible_v<Tt(*)[], T(*)[]>, int> = 0>
-					void operator()(Tt* _Ptr) const noexcept /* strengthened */ 
-					{ // delete a pointer
-						static_assert(0 < sizeof(Tt), "can't delete an incomplete type");
-						delete[] _Ptr;
-					}
-				};
+		//----------------------------------------------------------
+		// Inline storage with allocator（allocate_shared）
+		// object is constructed through A rebound to T, block memory comes from A rebound to the block
+		template<typename T, typename A>
+		class sp_counted_impl_pdia final : public sp_counted_base
+		{
+			typedef sp_counted_impl_pdia<T, A> this_type;
+			typedef typename std::allocator_traits<A>::template rebind_alloc<T> value_allocator;
+			typedef typename std::allocator_traits<A>::template rebind_alloc<this_type> block_allocator;
+		public:
+			template<typename... Args>
+			explicit sp_counted_impl_pdia(A const& a, Args&&... args) : alloc(a), constructed_(true)
+			{
+				value_allocator a2(alloc);
+				std::allocator_traits<value_allocator>::construct(a2, get(), std::forward<Args>(args)...);
+				sp_stats_bind<T>(this, sizeof(*this));
+			}
 
-				template<typename T, typename D>
-				class uniq_ptr_impl
+			virtual void dispose() override
+			{
+				if (constructed_)
 				{
-					template<typename U, typename V> friend class uniq_ptr_impl;
-				private:
-					union unique_ptr_data
-					{
-						T* m_ptr;
-						typename std::aligned_storage<sizeof(D), std::alignment_of<D>::value>::type deleter_storage;
-						constexpr unique_ptr_data(T* ptr) : m_ptr(ptr) {}
-					} up_union_data;
-				public:
-					D& get_deleter() noexcept
-					{
-						return *reinterpret_cast<D*>(&up_union_data.deleter_storage);
-					}
+					value_allocator a2(alloc);
+					std::allocator_traits<value_allocator>::destroy(a2, get());
+					constructed_ = false;
+				}
+			}
 
-					const D& get_deleter() const noexcept
-					{
-						return *reinterpret_cast<const D*>(&up_union_data.deleter_storage);
-					}
-		
-					T* get() const noexcept { return up_union_data.m_ptr; }
+			virtual void destroy() override
+			{
+				block_allocator a2(alloc);
+				this->~this_type();
+				std::allocator_traits<block_allocator>::deallocate(a2, this, 1);
+			}
 
-                    uniq_ptr_impl() noexcept : up_union_data(nullptr) {}
+			virtual void dispose_destroy() override
+			{
+				dispose();
+				destroy();
+			}
 
-					explicit uniq_ptr_impl(T* ptr) : up_union_data(ptr) {}
+			T* get() const noexcept
+			{
+				return const_cast<T*>(reinterpret_cast<T const*>(&storage_block));
+			}
 
-					uniq_ptr_impl(T* ptr, D&& deleter) noexcept : up_union_data(ptr)
-					{
-						new (&up_union_data.deleter_storage) D(std::move(deleter));
-					}
+			// allocate the block from a and construct it, returning the memory to a on failure
+			template<typename... Args>
+			static this_type* create(A const& a, Args&&... args)
+			{
+				block_allocator a2(a);
+				this_type* pi = std::allocator_traits<block_allocator>::allocate(a2, 1);
+				try
+				{
+					::new (static_cast<void*>(pi)) this_type(a, std::forward<Args>(args)...);
+				}
+				catch (...)
+				{
+					std::allocator_traits<block_allocator>::deallocate(a2, pi, 1);
+					throw;
+				}
+				return pi;
+			}
+		private:
+			typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage_block;
+			A alloc;
+			bool constructed_;
+		};
 
-					uniq_ptr_impl(uniq_ptr_impl&& other) noexcept : up_union_data(other.up_union_data.m_ptr) 
-					{
-						if (other.get() != nullptr) 
-						{
-							new (&up_union_data.deleter_storage) D(std::move(other.get_deleter()));
-						}
-						other.up_union_data.m_ptr = nullptr;
-					}
+		//----------------------------------------------------------
+		// Inline array storage（make_shared<T[]> / make_shared<T[N]>）
+		// the n elements follow the block in the same allocation
+		template<typename T, typename CB = sp_counted_base>
+		class sp_counted_impl_pdi_array final : public CB
+		{
+			typedef sp_counted_impl_pdi_array<T, CB> this_type;
+		public:
+			virtual void dispose() override
+			{
+				destroy_elements(m_size);
+			}
 
-					template<typename U, typename V>
-					uniq_ptr_impl(uniq_ptr_impl<U, V>&& other) noexcept  : up_union_data(other.up_union_data.m_ptr)
+			virtual void destroy() override
+			{
+				this->~this_type();
+				deallocate(this);
+			}
+
+			virtual void dispose_destroy() override
+			{
+				destroy_elements(m_size);
+				this->~this_type();
+				deallocate(this);
+			}
+
+			T* get() const noexcept
+			{
+				return reinterpret_cast<T*>(reinterpret_cast<char*>(const_cast<this_type*>(this)) + elements_offset());
+			}
+
+			std::size_t size() const noexcept
+			{
+				return m_size;
+			}
+
+			// value-initialize the elements (default-initialize without value_init), or copy
+			// each from *value when it is given
+			static this_type* create(std::size_t n, T const* value, bool value_init = true)
+			{
+				return create_with(n, [value, value_init](void* where)
+					{
+						if (value != nullptr)
+						{
+							::new (where) T(*value);
+						}
+						else if (value_init)
+						{
+							::new (where) T();
+						}
+						else
+						{
+							::new (where) T;
+						}
+					});
+			}
+
+			// construct each element with init(address); elements built so far are destroyed if one throws
+			template<typename Init>
+			static this_type* create_with(std::size_t n, Init const& init)
+			{
+				this_type* pi = ::new (allocate(n)) this_type(0);
+				sp_stats_bind<T[]>(pi, elements_offset() + n * sizeof(T));
+				T* p = pi->get();
+				try
+				{
+					for (; pi->m_size < n; ++pi->m_size)
+					{
+						init(static_cast<void*>(p + pi->m_size));
+					}
+				}
+				catch (...)
+				{
+					pi->destroy_elements(pi->m_size);
+					pi->~this_type();
+					deallocate(pi);
+					throw;
+				}
+				return pi;
+			}
+		private:
+			explicit sp_counted_impl_pdi_array(std::size_t n) : m_size(n) {}
+
+			static constexpr std::size_t alignment() noexcept
+			{
+				return alignof(this_type) > alignof(T) ? alignof(this_type) : alignof(T);
+			}
+
+			static constexpr std::size_t elements_offset() noexcept
+			{
+				return (sizeof(this_type) + alignof(T) - 1) / alignof(T) * alignof(T);
+			}
+
+			static void* allocate(std::size_t n)
+			{
+				if (n > (std::size_t(-1) - elements_offset()) / sizeof(T))
+				{
+					throw std::bad_array_new_length();
+				}
+				return ::operator new(elements_offset() + n * sizeof(T), std::align_val_t(alignment()));
+			}
+
+			static void deallocate(void* p) noexcept
+			{
+				::operator delete(p, std::align_val_t(alignment()));
+			}
+
+			void destroy_elements(std::size_t n) noexcept
+			{
+				T* p = get();
+				while (n != 0)
+				{
+					p[--n].~T();
+				}
+			}
+		private:
+			std::size_t m_size;
+		};
+
+		namespace 
+		{
+			namespace detail
+			{
+				template<typename T> struct sp_element { typedef T type; };
+				template<typename T> struct sp_element<T[]> { typedef T type; };
+				template<typename T, std::size_t N> struct sp_element<T[N]> { typedef T type; };
+
+				template<typename T> struct sp_dereference { typedef T& type; };
+				template<> struct sp_dereference<void> { typedef void type; };
+				template<> struct sp_dereference<void const> { typedef void type; };
+				template<> struct sp_dereference<void volatile> { typedef void type; };
+				template<> struct sp_dereference<void const volatile> { typedef void type; };
+
+				//template <class T>
+				//struct default_delete;
+
+				template <class  T>
+				struct default_delete // default deleter for unique_ptr 
+				{ 
+					constexpr default_delete() noexcept = default;
+
+					template <class Tt, std::enable_if_t<std::is_convertible_v<Tt*, T*>, int> = 0>
+					default_delete(const default_delete<Tt>&) noexcept {}
+
+					void operator()(T* _Ptr) const noexcept /* strengthened */ 
+					{ // delete a pointer
+						static_assert(0 < sizeof(T), "can't delete an incomplete type");
+						delete _Ptr;
+					}
+				};
+
+				template <class T>
+				struct default_delete<T[]>  // default deleter for unique_ptr to array of unknown size
+				{ 
+					constexpr default_delete() noexcept = default;
+
+					template <class Tt, std::enable_if_t<std::is_convertible_v<Tt(*)[], T(*)[]>, int> = 0>
+					default_delete(const default_delete<Tt[]>&) noexcept {}
+
+					template <class Tt, std::enable_if_t<std::is_convertible_v<Tt(*)[], T(*)[]>, int> = 0>
+					void operator()(Tt* _Ptr) const noexcept /* strengthened */ 
+					{ // delete a pointer
+						static_assert(0 < sizeof(Tt), "can't delete an incomplete type");
+						delete[] _Ptr;
+					}
+				};
+
+				// uniq_deleter_holder: the deleter half of the compressed pair. An empty,
+				// non-final deleter becomes a base and takes no space; anything else,
+				// including a reference to a deleter, is stored as a member.
+				template<typename D, bool = std::is_empty<D>::value && !std::is_final<D>::value>
+				class uniq_deleter_holder : private D
+				{
+				public:
+					uniq_deleter_holder() : D() {}
+
+					template<typename E>
+					explicit uniq_deleter_holder(E&& d) : D(std::forward<E>(d)) {}
+
+					D& deleter() noexcept { return *this; }
+					const D& deleter() const noexcept { return *this; }
+				};
+
+				template<typename D>
+				class uniq_deleter_holder<D, false>
+				{
+				public:
+					uniq_deleter_holder() : m_deleter() {}
+
+					template<typename E>
+					explicit uniq_deleter_holder(E&& d) : m_deleter(std::forward<E>(d)) {}
+
+					D& deleter() noexcept { return m_deleter; }
+					const D& deleter() const noexcept { return m_deleter; }
+				private:
+					D m_deleter;
+				};
+
+				// uniq_ptr_impl: pointer plus deleter, one pointer wide for stateless deleters
+				template<typename T, typename D>
+				class uniq_ptr_impl : private uniq_deleter_holder<D>
+				{
+					typedef uniq_deleter_holder<D> holder_type;
+				public:
+					uniq_ptr_impl() noexcept : holder_type(), m_ptr(nullptr) {}
+
+					explicit uniq_ptr_impl(T* ptr) noexcept : holder_type(), m_ptr(ptr) {}
+
+					template<typename E>
+					uniq_ptr_impl(T* ptr, E&& deleter) noexcept : holder_type(std::forward<E>(deleter)), m_ptr(ptr) {}
+
+					uniq_ptr_impl(uniq_ptr_impl&& other) noexcept
+						: holder_type(std::forward<D>(other.get_deleter())), m_ptr(other.release()) {}
+
+					uniq_ptr_impl& operator=(uniq_ptr_impl&& other) noexcept
 					{
-						static_assert(!std::is_reference<V>::value || std::is_same<V, D>::value, "incompatible deleter");
-						new (&up_union_data.deleter_storage) D(std::forward<V>(other.get_deleter()));
-						other.up_union_data.m_ptr = nullptr;
+						reset(other.release());
+						get_deleter() = std::forward<D>(other.get_deleter());
+						return *this;
 					}
 
 					~uniq_ptr_impl()
 					{
-						if (up_union_data.m_ptr)
-						{
-							get_deleter()(up_union_data.m_ptr);
-						}
-						if (up_union_data.m_ptr)
+						if (m_ptr != nullptr)
 						{
-                            get_deleter().~D();
+							get_deleter()(m_ptr);
 						}
 					}
 
+					D& get_deleter() noexcept
+					{
+						return holder_type::deleter();
+					}
+
+					const D& get_deleter() const noexcept
+					{
+						return holder_type::deleter();
+					}
+
+					T* get() const noexcept { return m_ptr; }
+
 					void reset(T* ptr) noexcept
 					{
-						T* old_ptr = up_union_data.m_ptr;
-						up_union_data.m_ptr = ptr;
+						T* old_ptr = m_ptr;
+						m_ptr = ptr;
 						if (old_ptr)
 						{
 							get_deleter()(old_ptr);
@@ -238,61 +889,1850 @@ namespace utils
 
 					T* release() noexcept
 					{
-						T* ptr = up_union_data.m_ptr;
-						up_union_data.m_ptr = nullptr;
+						T* ptr = m_ptr;
+						m_ptr = nullptr;
 						return ptr;
 					}
- 
+
+					void swap(uniq_ptr_impl& other) noexcept
+					{
+						using std::swap;
+						swap(m_ptr, other.m_ptr);
+						swap(get_deleter(), other.get_deleter());
+					}
+				private:
+					T* m_ptr;
+				};
+
+				static_assert(sizeof(uniq_ptr_impl<int, default_delete<int>>) == sizeof(int*), "stateless deleter must not add to the size");
+
+				// Middle Layer: moving is defaulted or deleted to match the deleter, so a
+				// move-only deleter gives a move-only unique_ptr and a non-movable one an
+				// immovable unique_ptr; trivial deleters move as a plain pointer copy
+				template<typename T, typename D, bool = std::is_move_constructible<D>::value, bool = std::is_move_assignable<D>::value>
+				class uniq_ptr_data : public uniq_ptr_impl<T, D>
+				{
+				public:
+					using uniq_ptr_impl<T, D>::uniq_ptr_impl;
+					uniq_ptr_data(uniq_ptr_data&&) = default;
+					uniq_ptr_data& operator=(uniq_ptr_data&&) = default;
+				};
+
+				template<typename T, typename D>
+				class uniq_ptr_data<T, D, true, false> : public uniq_ptr_impl<T, D>
+				{
+				public:
+					using uniq_ptr_impl<T, D>::uniq_ptr_impl;
+					uniq_ptr_data(uniq_ptr_data&&) = default;
+					uniq_ptr_data& operator=(uniq_ptr_data&&) = delete;
 				};
 
-				// Middle Layer - Provide type safety inspection and management functions
-				template<typename T, typename D, bool =std:: is_move_constructible<D>::value,bool = std::is_move_assignable<D>::value>
-				class uniq_ptr_data : private uniq_ptr_impl<T, D>
+				template<typename T, typename D>
+				class uniq_ptr_data<T, D, false, true> : public uniq_ptr_impl<T, D>
+				{
+				public:
+					using uniq_ptr_impl<T, D>::uniq_ptr_impl;
+					uniq_ptr_data(uniq_ptr_data&&) = delete;
+					uniq_ptr_data& operator=(uniq_ptr_data&&) = default;
+				};
+
+				template<typename T, typename D>
+				class uniq_ptr_data<T, D, false, false> : public uniq_ptr_impl<T, D>
 				{
-					typedef uniq_ptr_impl<T, D> base_type;
 				public:
-					using base_type::base_type;
-					using base_type::get;
-					using base_type::get_deleter;
-					using base_type::reset;
-					using base_type::release;
-					//uniq_ptr_data(uniq_ptr_data&&) = default;
-					//uniq_ptr_data& operator=(uniq_ptr_data&&) = default;
-				//	// constructor
-				//	constexpr uniq_ptr_data() noexcept : base_type() {}
-
-				//	explicit uniq_ptr_data(T* p) noexcept : base_type(p) {}
-
-				//	// constructor with deleter
-				//	uniq_ptr_data(T* p, const D& d) noexcept : base_type(p, const_cast<D&>(d)) {}
-
-				//	// move constructor
-				//	uniq_ptr_data(T* p, D&& d) noexcept : base_type(p, std::move(d)) {}
+					using uniq_ptr_impl<T, D>::uniq_ptr_impl;
+					uniq_ptr_data(uniq_ptr_data&&) = delete;
+					uniq_ptr_data& operator=(uniq_ptr_data&&) = delete;
 				};
 			}// namespace detail
 		}//empty namespace  
 
-		template<typename T> class weak_ptr;
-		template<typename T> class shared_ptr;
+		template<typename T> class weak_ptr;
+		template<typename T> class shared_ptr;
+		template<typename T> class local_weak_ptr;
+		template<typename T> class local_shared_ptr;
+		template<typename P> class sp_atomic_slot;
+		template<typename T> class enable_shared_from_this;
+
+		// hook run by the owning constructors and factories: fills the weak_ptr embedded in
+		// enable_shared_from_this bases, and does nothing for every other type
+		template<typename X, typename Y, typename T>
+		void sp_enable_shared_from_this(shared_ptr<X> const* ppx, Y const* py, enable_shared_from_this<T> const* pe) noexcept;
+
+		inline void sp_enable_shared_from_this(...) noexcept {}
+
+		template<typename T>
+		class shared_ptr
+		{
+			typedef typename detail::sp_element<T>::type element_type;
+			//using element_type = detail::sp_element<T>::type;
+			template<typename Y> friend class shared_ptr;
+			template<typename Y> friend class weak_ptr;
+			template<typename P> friend class sp_atomic_slot;
+			template<typename Y> friend class borrowed_ptr;
+			friend struct sp_bulk;
+			template<typename X, typename Y, typename U>
+			friend void sp_enable_shared_from_this(shared_ptr<X> const* ppx, Y const* py, enable_shared_from_this<U> const* pe) noexcept;
+		public:
+			using types=  typename shared_ptr<T>::element_type;
+			constexpr shared_ptr() noexcept : px(nullptr), pn(nullptr) {}
+
+			constexpr shared_ptr(nullptr_t) noexcept : px(nullptr), pn(nullptr) {} // construct empty shared_ptr
+			template<typename Y>
+			explicit shared_ptr(Y* p) noexcept : px(p), pn(nullptr)
+			{
+				try
+				{
+					pn = new sp_counted_impl_p<Y>(p);
+					sp_enable_shared_from_this(this, p, p);
+				}
+				catch (...)
+				{
+					delete p;
+					throw;
+				}
+			}
+
+			template<typename Y, typename D>
+			shared_ptr(Y* p, D d) noexcept  : px(p), pn(nullptr)
+			{
+				try
+				{
+					pn = new sp_counted_impl_pd<Y, D>(p, std::move(d));
+					sp_enable_shared_from_this(this, p, p);
+				}
+				catch (...)
+				{
+					d(p);
+					throw;
+				}
+			}
+
+			template<typename Y, typename D, typename A>
+			shared_ptr(Y* p, D d, A a) : px(p), pn(nullptr)
+			{
+				typedef sp_counted_impl_pda<Y, D, A> impl_type;
+				typedef typename std::allocator_traits<A>::template rebind_alloc<impl_type> block_allocator;
+				block_allocator a2(a);
+				impl_type* pi = nullptr;
+				try
+				{
+					pi = std::allocator_traits<block_allocator>::allocate(a2, 1);
+					::new (static_cast<void*>(pi)) impl_type(p, d, a);
+				}
+				catch (...)
+				{
+					if (pi != nullptr)
+					{
+						std::allocator_traits<block_allocator>::deallocate(a2, pi, 1);
+					}
+					d(p);
+					throw;
+				}
+				pn = pi;
+				sp_enable_shared_from_this(this, p, p);
+			}
+
+			//copy constructor
+			shared_ptr(shared_ptr const& r) noexcept : px(r.px), pn(r.pn)
+			{
+				if (pn != nullptr)
+				{
+					pn->add_ref_copy();
+				}
+			}
+
+			template<typename Y>
+			shared_ptr(shared_ptr<Y> const& r) noexcept : px(r.px), pn(r.pn)
+			{
+				if (pn != nullptr) {
+					pn->add_ref_copy();
+				}
+			}
+
+			// a thread-local owner can't be promoted to an atomic one
+			template<typename Y>
+			shared_ptr(local_shared_ptr<Y> const& r) = delete;
+
+			// move constructor
+			shared_ptr(shared_ptr&& r) noexcept  : px(r.px), pn(std::move(r).pn)
+			{
+				r.px = nullptr;
+				r.pn = nullptr;
+			}
+
+			template<typename Y>
+			shared_ptr(shared_ptr<Y>&& r) noexcept  : px(r.px), pn(std::move(r).pn)
+			{
+				r.px = nullptr;
+				r.pn = nullptr;
+			}
+
+			// Alias constructor
+			template<typename Y>
+			shared_ptr(shared_ptr<Y> const& r, element_type* p) noexcept  : px(p), pn(r.pn)
+			{
+				if (pn != nullptr)
+				{
+					pn->add_ref_copy();
+				}
+			}
+
+			template<typename Y>
+			shared_ptr(shared_ptr<Y> const&& r, element_type* p) noexcept  : px(p), pn(std::move(r).pn)
+			{
+				if (pn != nullptr)
+				{
+					pn->add_ref_copy();
+				}
+			}
+			// destructor
+			~shared_ptr() noexcept
+			{
+				if (pn != nullptr)
+				{
+					pn->release();
+				}
+			}
+
+			void swap(shared_ptr& other) noexcept
+			{
+				std::swap(px, other.px);
+				std::swap(pn, other.pn);
+			}
+
+			// reset
+			void reset() noexcept
+			{
+				shared_ptr().swap(*this);
+			}
+
+			template<typename Y>
+			void reset(Y* p)
+			{
+				shared_ptr(p).swap(*this);
+			}
+
+			template<typename Y, typename D>
+			void reset(Y* p, D d)
+			{
+				shared_ptr(p, d).swap(*this);
+			}
+
+			template<typename Y, typename D, typename A>
+			void reset(Y* p, D d, A a)
+			{
+				shared_ptr(p, d, a).swap(*this);
+			}
+
+			// observer
+			typename detail::sp_dereference<T>::type operator*() const noexcept
+			{
+				return *px;
+			}
+
+			element_type* operator->() const  noexcept
+			{
+				return px;
+			}
+
+			element_type* get() const noexcept
+			{
+				return px;
+			}
+
+			// array access operator, shared_ptr<T[]> / shared_ptr<T[N]> only
+			template<typename Y = T>
+			typename std::enable_if<std::is_array<Y>::value, typename detail::sp_element<Y>::type&>::type operator[](std::ptrdiff_t i) const noexcept
+			{
+				return px[i];
+			}
+
+			long use_count() const noexcept
+			{
+				return pn ? pn->use_count() : 0;
+			}
+
+			bool unique() const noexcept
+			{
+				return use_count() == 1;
+			}
+
+			explicit operator bool() const noexcept
+			{
+				return px != nullptr;
+			}
+
+			// Assignment operation
+			shared_ptr& operator=(shared_ptr const& r) noexcept
+			{
+				shared_ptr(r).swap(*this);
+				return *this;
+			}
+
+			template<typename Y>
+			shared_ptr& operator=(shared_ptr<Y> const& r) noexcept
+			{
+				shared_ptr(r).swap(*this);
+				return *this;
+			}
+
+			shared_ptr& operator=(shared_ptr&& r) noexcept
+			{
+				shared_ptr(std::move(r)).swap(*this);
+				return *this;
+			}
+
+			template<typename Y>
+			shared_ptr& operator=(shared_ptr<Y>&& r) noexcept
+			{
+				shared_ptr(std::move(r)).swap(*this);
+				return *this;
+			}
+		private:
+			template<typename Y, typename... Args>
+			friend typename std::enable_if<!std::is_array<Y>::value, shared_ptr<Y>>::type make_shared(Args&&... _Args)noexcept(std::is_nothrow_constructible_v<Y, Args...>);
+			template<typename Y, typename A, typename... Args>
+			friend shared_ptr<Y> allocate_shared(A const& a, Args&&... args);
+			template<typename Y>
+			friend shared_ptr<Y> sp_adopt_block(typename shared_ptr<Y>::types* px, sp_counted_base* pn) noexcept;
+			void  set_ptr_rep(element_type* px, sp_counted_base* p)
+			{
+				this->px = px;
+				this->pn = p;
+			}
+		private:
+			element_type* px;
+			sp_counted_base* pn;
+
+		};
+
+		// comparison operator
+		template<typename T, typename U>
+		inline bool operator==(shared_ptr<T> const& Lv, shared_ptr<U> const& Rv) noexcept
+		{
+			return Lv.get() == Rv.get();
+		}
+
+		template<typename T, typename U>
+		inline bool operator!=(shared_ptr<T> const& Lv, shared_ptr<U> const& Rv) noexcept
+		{
+			return  Lv.get() != Rv.get();
+		}
+
+		template<typename T, typename U>
+		inline bool operator<(shared_ptr<T> const& Lv, shared_ptr<U> const& Rv) noexcept
+		{
+			return std::less<typename std::common_type<T*, U*>::type>()(Lv.get(), Rv.get());
+		}
+
+		template<typename T, typename U>
+		inline bool operator<=(shared_ptr<T> const& Lv, shared_ptr<U> const& Rv) noexcept
+		{
+			return !(Rv.get() < Lv.get());
+		}
+
+		template<typename T, typename U>
+		inline bool operator>(shared_ptr<T> const& Lv, shared_ptr<U> const& Rv) noexcept
+		{
+			return Rv.get() < Lv.get();
+		}
+
+		template<typename T, typename U>
+		inline bool operator>=(shared_ptr<T> const& Lv, shared_ptr<U> const& Rv) noexcept
+		{
+			return !(Lv.get() < Rv.get());
+		}
+
+		// A family of type conversion functions
+		template<typename T, typename U>
+		shared_ptr<T> static_pointer_cast(shared_ptr<U> const& r) noexcept
+		{
+			(void) static_cast<T*>(static_cast<U*>(0));
+			typedef typename shared_ptr<T>::types E;
+			E* p = static_cast<E*>(r.get());
+			return shared_ptr<T>(r, p);
+		}
+
+		template<typename T, typename U>
+		shared_ptr<T> dynamic_pointer_cast(shared_ptr<U> const& r) noexcept
+		{
+			(void) dynamic_cast<T*>(static_cast<U*>(0));
+			typedef typename shared_ptr<T>::types E;
+			E* p = dynamic_cast<E*>(r.get());
+			return p ? shared_ptr<T>(r, p) : shared_ptr<T>();
+		}
+
+		template<typename T, typename U>
+		shared_ptr<T> const_pointer_cast(shared_ptr<U> const& r) noexcept
+		{
+			(void) const_cast<T*>(static_cast<U*>(0));
+			typedef typename shared_ptr<T>::types E;
+			E* p = const_cast<E*>(r.get());
+			return shared_ptr<T>(r, p);
+		}
+
+		template<typename T, typename... Args>
+		shared_ptr<T> make_shared_on_node(int node, Args&&... args);
+
+		//make_shared
+
+		template<typename T, typename... Args>
+		typename std::enable_if<!std::is_array<T>::value, shared_ptr<T>>::type make_shared(Args&&... args)noexcept(std::is_nothrow_constructible_v<T, Args...>)
+		{
+			typedef typename   std::remove_cv<T>::type  T_ncv;
+			if constexpr (sp_separate_counts<T_ncv>::value)
+			{
+				return make_shared_on_node<T>(sp_node_heap::current_node(), std::forward<Args>(args)...);
+			}
+			else
+			{
+				sp_counted_impl_pdi<T_ncv>* pi = new sp_counted_impl_pdi<T_ncv>(std::forward<Args>(args)...);
+				shared_ptr<T> Ret;
+				Ret.set_ptr_rep(pi->get(), pi);
+				sp_enable_shared_from_this(&Ret, Ret.get(), Ret.get());
+				return Ret;
+			}
+		}
+
+		//allocate_shared: control block and object share one allocation from a
+		template<typename T, typename A, typename... Args>
+		shared_ptr<T> allocate_shared(A const& a, Args&&... args)
+		{
+			typedef typename   std::remove_cv<T>::type  T_ncv;
+			sp_counted_impl_pdia<T_ncv, A>* pi = sp_counted_impl_pdia<T_ncv, A>::create(a, std::forward<Args>(args)...);
+			shared_ptr<T> Ret;
+			Ret.set_ptr_rep(pi->get(), pi);
+			sp_enable_shared_from_this(&Ret, Ret.get(), Ret.get());
+			return Ret;
+		}
+
+		// wrap a freshly created control block (holding one strong reference) in a shared_ptr
+		template<typename T>
+		shared_ptr<T> sp_adopt_block(typename shared_ptr<T>::types* px, sp_counted_base* pn) noexcept
+		{
+			shared_ptr<T> Ret;
+			Ret.set_ptr_rep(px, pn);
+			return Ret;
+		}
+
+		//make_shared_on_node: counts and object on separate cache lines, the block in memory of NUMA node `node`
+		template<typename T, typename... Args>
+		shared_ptr<T> make_shared_on_node(int node, Args&&... args)
+		{
+			static_assert(!std::is_array<T>::value, "make_shared_on_node does not support arrays");
+			typedef typename std::remove_cv<T>::type T_ncv;
+			sp_counted_impl_pdi_separate<T_ncv>* pi = sp_counted_impl_pdi_separate<T_ncv>::create(node, std::forward<Args>(args)...);
+			shared_ptr<T> Ret = sp_adopt_block<T>(pi->get(), pi);
+			sp_enable_shared_from_this(&Ret, Ret.get(), Ret.get());
+			return Ret;
+		}
+
+		//make_shared_separate: make_shared_on_node for the node the calling thread runs on
+		template<typename T, typename... Args>
+		shared_ptr<T> make_shared_separate(Args&&... args)
+		{
+			return make_shared_on_node<T>(sp_node_heap::current_node(), std::forward<Args>(args)...);
+		}
+
+		//make_shared for arrays: the elements live inline after the counts
+		template<typename T>
+		typename std::enable_if<std::is_array<T>::value && std::extent<T>::value == 0, shared_ptr<T>>::type make_shared(std::size_t n)
+		{
+			typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type E;
+			sp_counted_impl_pdi_array<E>* pi = sp_counted_impl_pdi_array<E>::create(n, nullptr);
+			return sp_adopt_block<T>(pi->get(), pi);
+		}
+
+		template<typename T>
+		typename std::enable_if<std::is_array<T>::value && std::extent<T>::value == 0, shared_ptr<T>>::type make_shared(std::size_t n, typename std::remove_extent<T>::type const& value)
+		{
+			typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type E;
+			sp_counted_impl_pdi_array<E>* pi = sp_counted_impl_pdi_array<E>::create(n, &value);
+			return sp_adopt_block<T>(pi->get(), pi);
+		}
+
+		template<typename T>
+		typename std::enable_if<std::is_array<T>::value && std::extent<T>::value != 0, shared_ptr<T>>::type make_shared()
+		{
+			typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type E;
+			sp_counted_impl_pdi_array<E>* pi = sp_counted_impl_pdi_array<E>::create(std::extent<T>::value, nullptr);
+			return sp_adopt_block<T>(pi->get(), pi);
+		}
+
+		template<typename T>
+		typename std::enable_if<std::is_array<T>::value && std::extent<T>::value != 0, shared_ptr<T>>::type make_shared(typename std::remove_extent<T>::type const& value)
+		{
+			typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type E;
+			sp_counted_impl_pdi_array<E>* pi = sp_counted_impl_pdi_array<E>::create(std::extent<T>::value, &value);
+			return sp_adopt_block<T>(pi->get(), pi);
+		}
+
+		//make_shared_for_overwrite: as make_shared, but the object or elements are
+		//default-initialized, so trivial types are left indeterminate instead of zeroed
+		template<typename T>
+		typename std::enable_if<!std::is_array<T>::value, shared_ptr<T>>::type make_shared_for_overwrite()
+		{
+			typedef typename std::remove_cv<T>::type T_ncv;
+			sp_counted_impl_pdi<T_ncv>* pi = new sp_counted_impl_pdi<T_ncv>(sp_for_overwrite_t());
+			shared_ptr<T> Ret = sp_adopt_block<T>(pi->get(), pi);
+			sp_enable_shared_from_this(&Ret, Ret.get(), Ret.get());
+			return Ret;
+		}
+
+		template<typename T>
+		typename std::enable_if<std::is_array<T>::value && std::extent<T>::value == 0, shared_ptr<T>>::type make_shared_for_overwrite(std::size_t n)
+		{
+			typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type E;
+			sp_counted_impl_pdi_array<E>* pi = sp_counted_impl_pdi_array<E>::create(n, nullptr, false);
+			return sp_adopt_block<T>(pi->get(), pi);
+		}
+
+		template<typename T>
+		typename std::enable_if<std::is_array<T>::value && std::extent<T>::value != 0, shared_ptr<T>>::type make_shared_for_overwrite()
+		{
+			typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type E;
+			sp_counted_impl_pdi_array<E>* pi = sp_counted_impl_pdi_array<E>::create(std::extent<T>::value, nullptr, false);
+			return sp_adopt_block<T>(pi->get(), pi);
+		}
+
+		//make_shared_batch: n objects, each built from args, in one allocation with one
+		//control block; every element gets its own shared_ptr (aliasing the whole batch),
+		//so all of them stay alive until the last of those is gone
+		template<typename T, typename... Args>
+		std::vector<shared_ptr<T>> make_shared_batch(std::size_t n, Args const&... args)
+		{
+			typedef typename std::remove_cv<T>::type T_ncv;
+			sp_counted_impl_pdi_array<T_ncv>* pi = sp_counted_impl_pdi_array<T_ncv>::create_with(n, [&args...](void* where)
+				{
+					::new (where) T_ncv(args...);
+				});
+			shared_ptr<T[]> batch = sp_adopt_block<T[]>(pi->get(), pi);
+			std::vector<shared_ptr<T>> Ret;
+			Ret.reserve(n);
+			// one count update for all n aliases, as share_n does
+			pi->add_ref_copy(static_cast<long>(n));
+			for (std::size_t i = 0; i < n; ++i)
+			{
+				Ret.push_back(sp_adopt_block<T>(pi->get() + i, pi));
+			}
+			return Ret;
+		}
+
+		template<typename Tuple, typename... Ts, std::size_t... I>
+		std::tuple<shared_ptr<Ts>...> sp_split_tuple(shared_ptr<Tuple> const& whole, std::index_sequence<I...>)
+		{
+			return std::tuple<shared_ptr<Ts>...>(shared_ptr<Ts>(whole, &std::get<I>(*whole))...);
+		}
+
+		//make_shared_tuple<A, B, C>(a, b, c): one object of each type in one allocation,
+		//each built from its own argument (or all default-constructed when none are given)
+		template<typename... Ts, typename... Args>
+		std::tuple<shared_ptr<Ts>...> make_shared_tuple(Args&&... args)
+		{
+			static_assert(sizeof...(Args) == 0 || sizeof...(Args) == sizeof...(Ts), "one argument per type, or none");
+			shared_ptr<std::tuple<Ts...>> whole = utils::sp::make_shared<std::tuple<Ts...>>(std::forward<Args>(args)...);
+			return sp_split_tuple<std::tuple<Ts...>, Ts...>(whole, std::index_sequence_for<Ts...>());
+		}
+
+//-------------------weak_ptr---------------------------------
+		template<typename T>
+		class weak_ptr
+		{
+			template<typename Y> friend class weak_ptr;
+			template<typename Y> friend class shared_ptr;
+			template<typename P> friend class sp_atomic_slot;
+			template<typename Y> friend class enable_shared_from_this;
+		public:
+			// constructor
+			constexpr weak_ptr() : px(nullptr), pn(nullptr) {}
+
+			template<typename Y>
+			weak_ptr(shared_ptr<Y> const& r) noexcept  : px(r.px), pn(r.pn)
+			{
+				if (pn != nullptr) 
+				{
+					pn->weak_add_ref();
+				}
+			}
+
+			// copy constructor
+			weak_ptr(weak_ptr const& r) noexcept : px(r.px), pn(r.pn)
+			{
+				if (pn != nullptr) 
+				{
+					pn->weak_add_ref();
+				}
+			}
+
+			template<typename Y>
+			weak_ptr(weak_ptr<Y> const& r) noexcept : px(r.lock().get()), pn(r.pn)
+			{
+				if (pn != nullptr) 
+				{
+					pn->weak_add_ref();
+				}
+			}
+
+			// move constructor
+			weak_ptr(weak_ptr&& r) noexcept  : px(r.px), pn(r.pn)
+			{
+				r.px = nullptr;
+				r.pn = nullptr;
+			}
+
+			template<typename Y>
+			weak_ptr(weak_ptr<Y>&& r) noexcept  : px(r.px), pn(r.pn)
+			{
+				r.px = nullptr;
+				r.pn = nullptr;
+			}
+
+			// Assignment operation
+			weak_ptr& operator=(weak_ptr const& r) noexcept
+			{
+				weak_ptr(r).swap(*this);
+				return *this;
+			}
+
+			template<typename Y>
+			weak_ptr& operator=(weak_ptr<Y> const& r) noexcept
+			{
+				weak_ptr(r).swap(*this);
+				return *this;
+			}
+
+			template<typename Y>
+			weak_ptr& operator=(shared_ptr<Y> const& r) noexcept
+			{
+				weak_ptr(r).swap(*this);
+				return *this;
+			}
+
+			weak_ptr& operator=(weak_ptr&& r)  noexcept
+			{
+				weak_ptr(std::move(r)).swap(*this);
+				return *this;
+			}
+
+			template<typename Y>
+			weak_ptr& operator=(weak_ptr<Y>&& r) noexcept
+			{
+				weak_ptr(std::move(r)).swap(*this);
+				return *this;
+			}
+
+			// destrouctor
+			~weak_ptr() noexcept
+			{
+				if (pn != nullptr) 
+				{
+					pn->weak_release();
+				}
+			}
+
+			// reset
+			void reset() noexcept
+			{
+				weak_ptr().swap(*this);
+			}
+
+			// swap
+			void swap(weak_ptr& other) noexcept
+			{
+				std::swap(px, other.px);
+				std::swap(pn, other.pn);
+			}
+
+			// observer
+			long use_count() const noexcept
+			{
+				return pn ? pn->use_count() : 0;
+			}
+
+			bool expired() const noexcept 
+			{
+				return use_count() == 0;
+			}
+
+			shared_ptr<T> lock() const noexcept
+			{
+				// no expired() pre-check: add_ref_lock itself refuses a zero use count
+				if (pn == nullptr || !pn->add_ref_lock())
+				{
+					return shared_ptr<T>();
+				}
+
+				shared_ptr<T> p;
+				p.px = px;
+				p.pn = pn;
+				return p;
+			}
+		private:
+			typedef typename detail::sp_element<T>::type element_type;
+			element_type* px;
+			sp_counted_base* pn;
+		};
+
+//-------------------enable_shared_from_this---------------------------------
+		// enable_shared_from_this<T>: the first owner (make_shared, allocate_shared or one of
+		// the adopting constructors) points the embedded weak_ptr at its own control block,
+		// which costs one weak increment and no allocation
+		template<typename T>
+		class enable_shared_from_this
+		{
+		protected:
+			constexpr enable_shared_from_this() noexcept {}
+
+			enable_shared_from_this(enable_shared_from_this const&) noexcept {}
+
+			enable_shared_from_this& operator=(enable_shared_from_this const&) noexcept
+			{
+				return *this;
+			}
+
+			~enable_shared_from_this() = default;
+		public:
+			shared_ptr<T> shared_from_this()
+			{
+				shared_ptr<T> p = weak_this.lock();
+				if (!p)
+				{
+					throw std::bad_weak_ptr();
+				}
+				return p;
+			}
+
+			shared_ptr<T const> shared_from_this() const
+			{
+				shared_ptr<T const> p = weak_this.lock();
+				if (!p)
+				{
+					throw std::bad_weak_ptr();
+				}
+				return p;
+			}
+
+			weak_ptr<T> weak_from_this() noexcept
+			{
+				return weak_this;
+			}
+
+			weak_ptr<T const> weak_from_this() const noexcept
+			{
+				return weak_this;
+			}
+		private:
+			template<typename X, typename Y, typename U>
+			friend void sp_enable_shared_from_this(shared_ptr<X> const* ppx, Y const* py, enable_shared_from_this<U> const* pe) noexcept;
+
+			// adopt the first owner, or a new one once every earlier owner has let go
+			void accept_owner(T* px, sp_counted_base* pn) const noexcept
+			{
+				if (pn != nullptr && weak_this.expired())
+				{
+					pn->weak_add_ref();
+					sp_counted_base* old = weak_this.pn;
+					weak_this.px = px;
+					weak_this.pn = pn;
+					if (old != nullptr)
+					{
+						old->weak_release();
+					}
+				}
+			}
+
+			mutable weak_ptr<T> weak_this;
+		};
+
+		template<typename X, typename Y, typename T>
+		inline void sp_enable_shared_from_this(shared_ptr<X> const* ppx, Y const* py, enable_shared_from_this<T> const* pe) noexcept
+		{
+			if (pe != nullptr)
+			{
+				pe->accept_owner(static_cast<T*>(const_cast<Y*>(py)), ppx->pn);
+			}
+		}
+
+//-------------------compact_shared_ptr---------------------------------
+		// compact_shared_ptr<T>: a shared_ptr that is one pointer wide. It only ever owns
+		// the single-allocation block of make_compact_shared, where the object sits at a
+		// fixed offset from the counts, so the object address is derived instead of stored.
+		// No aliasing, no conversion between element types, and no deleter or allocator;
+		// share() hands out an ordinary shared_ptr to the same object when one is needed.
+		template<typename T>
+		class compact_shared_ptr
+		{
+			static_assert(!std::is_array<T>::value, "compact_shared_ptr does not support arrays");
+			typedef sp_counted_impl_pdi<typename std::remove_cv<T>::type> block_type;
+		public:
+			typedef T element_type;
+
+			constexpr compact_shared_ptr() noexcept : pn(nullptr) {}
+
+			constexpr compact_shared_ptr(std::nullptr_t) noexcept : pn(nullptr) {}
+
+			compact_shared_ptr(compact_shared_ptr const& r) noexcept : pn(r.pn)
+			{
+				if (pn != nullptr)
+				{
+					pn->add_ref_copy();
+				}
+			}
+
+			compact_shared_ptr(compact_shared_ptr&& r) noexcept : pn(r.pn)
+			{
+				r.pn = nullptr;
+			}
+
+			~compact_shared_ptr() noexcept
+			{
+				if (pn != nullptr)
+				{
+					pn->release();
+				}
+			}
+
+			void swap(compact_shared_ptr& other) noexcept
+			{
+				std::swap(pn, other.pn);
+			}
+
+			void reset() noexcept
+			{
+				compact_shared_ptr().swap(*this);
+			}
+
+			T& operator*() const noexcept
+			{
+				return *get();
+			}
+
+			T* operator->() const noexcept
+			{
+				return get();
+			}
+
+			T* get() const noexcept
+			{
+				return pn != nullptr ? pn->get() : nullptr;
+			}
+
+			long use_count() const noexcept
+			{
+				return pn ? pn->use_count() : 0;
+			}
+
+			explicit operator bool() const noexcept
+			{
+				return pn != nullptr;
+			}
+
+			// a full shared_ptr owning the same object
+			shared_ptr<T> share() const noexcept
+			{
+				if (pn == nullptr)
+				{
+					return shared_ptr<T>();
+				}
+				pn->add_ref_copy();
+				return sp_adopt_block<T>(pn->get(), pn);
+			}
+
+			compact_shared_ptr& operator=(compact_shared_ptr const& r) noexcept
+			{
+				compact_shared_ptr(r).swap(*this);
+				return *this;
+			}
+
+			compact_shared_ptr& operator=(compact_shared_ptr&& r) noexcept
+			{
+				compact_shared_ptr(std::move(r)).swap(*this);
+				return *this;
+			}
+		private:
+			template<typename Y, typename... Args>
+			friend compact_shared_ptr<Y> make_compact_shared(Args&&... args);
+
+			explicit compact_shared_ptr(block_type* p) noexcept : pn(p) {}
+		private:
+			block_type* pn;
+		};
+
+		static_assert(sizeof(compact_shared_ptr<int>) == sizeof(void*), "compact_shared_ptr must be one pointer wide");
+
+		template<typename T, typename U>
+		inline bool operator==(compact_shared_ptr<T> const& Lv, compact_shared_ptr<U> const& Rv) noexcept
+		{
+			return Lv.get() == Rv.get();
+		}
+
+		template<typename T, typename U>
+		inline bool operator!=(compact_shared_ptr<T> const& Lv, compact_shared_ptr<U> const& Rv) noexcept
+		{
+			return Lv.get() != Rv.get();
+		}
+
+		template<typename T, typename U>
+		inline bool operator<(compact_shared_ptr<T> const& Lv, compact_shared_ptr<U> const& Rv) noexcept
+		{
+			return std::less<typename std::common_type<T*, U*>::type>()(Lv.get(), Rv.get());
+		}
+
+		// enable_shared_from_this for compact owners: weak_this is filled from a
+		// temporary shared_ptr, other types pay nothing
+		template<typename Y, typename U>
+		inline void sp_compact_enable_shared_from_this(sp_counted_base* pn, Y* py, enable_shared_from_this<U> const* pe) noexcept
+		{
+			pn->add_ref_copy();
+			shared_ptr<Y> owner = sp_adopt_block<Y>(py, pn);
+			sp_enable_shared_from_this(&owner, py, pe);
+		}
+
+		inline void sp_compact_enable_shared_from_this(...) noexcept {}
+
+		//make_compact_shared
+		template<typename T, typename... Args>
+		compact_shared_ptr<T> make_compact_shared(Args&&... args)
+		{
+			typedef typename compact_shared_ptr<T>::block_type block_type;
+			block_type* pi = new block_type(std::forward<Args>(args)...);
+			sp_compact_enable_shared_from_this(pi, pi->get(), pi->get());
+			return compact_shared_ptr<T>(pi);
+		}
+
+//-------------------borrowed_ptr---------------------------------
+		// borrowed_ptr<T>: a non-owning view of an object some shared_ptr keeps alive,
+		// for passing down call chains without touching the counts. The caller keeps an
+		// owner for as long as the borrow lives; share() turns the borrow back into a
+		// full owner when a callee needs to keep the object.
+		// With SP_CHECK_BORROWS each borrow holds a weak reference on the block and
+		// asserts on use and on destruction that the object is still owned.
+		template<typename T>
+		class borrowed_ptr
+		{
+			template<typename Y> friend class borrowed_ptr;
+			typedef typename shared_ptr<T>::types element_type;
+		public:
+			constexpr borrowed_ptr() noexcept = default;
+
+			constexpr borrowed_ptr(std::nullptr_t) noexcept {}
+
+			template<typename Y, typename = typename std::enable_if<std::is_convertible<Y*, T*>::value>::type>
+			borrowed_ptr(shared_ptr<Y> const& r) noexcept : px(r.px), pn(r.pn)
+			{
+				attach();
+			}
+
+			// a borrow of a temporary would dangle as soon as the full expression ends
+			template<typename Y>
+			borrowed_ptr(shared_ptr<Y>&&) = delete;
+
+			borrowed_ptr(borrowed_ptr const& r) noexcept : px(r.px), pn(r.pn)
+			{
+				attach();
+			}
+
+			template<typename Y, typename = typename std::enable_if<std::is_convertible<Y*, T*>::value>::type>
+			borrowed_ptr(borrowed_ptr<Y> const& r) noexcept : px(r.px), pn(r.pn)
+			{
+				attach();
+			}
+
+			~borrowed_ptr() noexcept
+			{
+				detach();
+			}
+
+			borrowed_ptr& operator=(borrowed_ptr const& r) noexcept
+			{
+				borrowed_ptr(r).swap(*this);
+				return *this;
+			}
+
+			void swap(borrowed_ptr& other) noexcept
+			{
+				std::swap(px, other.px);
+				std::swap(pn, other.pn);
+			}
+
+			void reset() noexcept
+			{
+				borrowed_ptr().swap(*this);
+			}
+
+			element_type& operator*() const noexcept
+			{
+				return *get();
+			}
+
+			element_type* operator->() const noexcept
+			{
+				return get();
+			}
+
+			element_type* get() const noexcept
+			{
+				check();
+				return px;
+			}
+
+			explicit operator bool() const noexcept
+			{
+				return px != nullptr;
+			}
+
+			// a full shared_ptr owning the borrowed object
+			shared_ptr<T> share() const noexcept
+			{
+				check();
+				if (pn != nullptr)
+				{
+					pn->add_ref_copy();
+				}
+				return sp_adopt_block<T>(px, pn);
+			}
+
+			template<typename Y>
+			bool owner_before(borrowed_ptr<Y> const& r) const noexcept
+			{
+				return std::less<sp_counted_base*>()(pn, r.pn);
+			}
+		private:
+#ifdef SP_CHECK_BORROWS
+			void attach() const noexcept
+			{
+				if (pn != nullptr)
+				{
+					assert(pn->use_count() != 0 && "borrowed from an expired owner");
+					pn->weak_add_ref();
+				}
+			}
+
+			void detach() const noexcept
+			{
+				if (pn != nullptr)
+				{
+					assert(pn->use_count() != 0 && "borrowed_ptr outlived every owner of its object");
+					pn->weak_release();
+				}
+			}
+
+			void check() const noexcept
+			{
+				assert((pn == nullptr || pn->use_count() != 0) && "borrowed_ptr used after its owners released the object");
+			}
+#else
+			void attach() const noexcept {}
+			void detach() const noexcept {}
+			void check() const noexcept {}
+#endif
+		private:
+			element_type* px = nullptr;
+			sp_counted_base* pn = nullptr;
+		};
+
+		template<typename T, typename U>
+		inline bool operator==(borrowed_ptr<T> const& Lv, borrowed_ptr<U> const& Rv) noexcept
+		{
+			return Lv.get() == Rv.get();
+		}
+
+		template<typename T, typename U>
+		inline bool operator!=(borrowed_ptr<T> const& Lv, borrowed_ptr<U> const& Rv) noexcept
+		{
+			return Lv.get() != Rv.get();
+		}
+
+		template<typename T>
+		inline borrowed_ptr<T> borrow(shared_ptr<T> const& r) noexcept
+		{
+			return borrowed_ptr<T>(r);
+		}
+
+		template<typename T>
+		void borrow(shared_ptr<T>&&) = delete;
+
+//-------------------bulk reference counting---------------------------------
+		// Copying or dropping many shared_ptrs that share a control block: one atomic
+		// operation per run of adjacent owners of the same block instead of one per owner.
+		struct sp_bulk
+		{
+			template<typename T>
+			static sp_counted_base* counts(shared_ptr<T> const& p) noexcept
+			{
+				return p.pn;
+			}
+
+			// an owner of p's object taking a reference already counted on pn
+			template<typename T>
+			static shared_ptr<T> adopt_like(shared_ptr<T> const& p, sp_counted_base* pn) noexcept
+			{
+				return sp_adopt_block<T>(p.get(), pn);
+			}
+
+			template<typename T>
+			static void forget(shared_ptr<T>& p) noexcept
+			{
+				p.px = nullptr;
+				p.pn = nullptr;
+			}
+
+			// give back the references counted for copies that were never written out
+			static void give_back(sp_counted_base* pn, long n) noexcept
+			{
+				if (pn != nullptr && n > 0)
+				{
+					pn->release(n);
+				}
+			}
+		};
+
+		// write n copies of sp to out
+		template<typename T, typename OutputIt>
+		OutputIt share_n(shared_ptr<T> const& sp, std::size_t n, OutputIt out)
+		{
+			sp_counted_base* pn = sp_bulk::counts(sp);
+			long left = static_cast<long>(n);
+			if (pn != nullptr && left != 0)
+			{
+				pn->add_ref_copy(left);
+			}
+			// left counts the references no shared_ptr owns yet; a copy in flight
+			// gives its own back if writing it out throws
+			try
+			{
+				while (left != 0)
+				{
+					shared_ptr<T> copy = sp_bulk::adopt_like(sp, pn);
+					--left;
+					*out = std::move(copy);
+					++out;
+				}
+			}
+			catch (...)
+			{
+				sp_bulk::give_back(pn, left);
+				throw;
+			}
+			return out;
+		}
+
+		// copy [first, last) of shared_ptrs to out
+		template<typename ForwardIt, typename OutputIt>
+		OutputIt share_all(ForwardIt first, ForwardIt last, OutputIt out)
+		{
+			while (first != last)
+			{
+				sp_counted_base* pn = sp_bulk::counts(*first);
+				ForwardIt run_end = first;
+				long left = 0;
+				while (run_end != last && sp_bulk::counts(*run_end) == pn)
+				{
+					++run_end;
+					++left;
+				}
+				if (pn != nullptr)
+				{
+					pn->add_ref_copy(left);
+				}
+				// as in share_n: left counts the references no shared_ptr owns yet
+				try
+				{
+					while (first != run_end)
+					{
+						auto copy = sp_bulk::adopt_like(*first, pn);
+						--left;
+						*out = std::move(copy);
+						++out;
+						++first;
+					}
+				}
+				catch (...)
+				{
+					sp_bulk::give_back(pn, left);
+					throw;
+				}
+			}
+			return out;
+		}
+
+		// empty every shared_ptr in [first, last)
+		template<typename ForwardIt>
+		void release_all(ForwardIt first, ForwardIt last) noexcept
+		{
+			while (first != last)
+			{
+				sp_counted_base* pn = sp_bulk::counts(*first);
+				long run = 0;
+				for (; first != last && sp_bulk::counts(*first) == pn; ++first, ++run)
+				{
+					sp_bulk::forget(*first);
+				}
+				if (pn != nullptr)
+				{
+					pn->release(run);
+				}
+			}
+		}
+
+//-------------------atomic_shared_ptr---------------------------------
+		// sp_atomic_slot<P>: lock-free atomic cell for a shared_ptr / weak_ptr, using split
+		// reference counts. A published value lives in its own sp_counted_impl_pdi<P> node;
+		// the atomic word packs the node address (low 48 bits) with the number of loads
+		// currently reading that node (high 16 bits).
+		//  - load takes a ticket with one fetch_add, copies the value out of the node, then
+		//    hands the ticket back with a CAS as long as the word still names the node.
+		//  - a published node carries reference_bias strong references for the slot. A writer
+		//    that swaps it out trades the bias for one reference per outstanding ticket, so
+		//    late readers drop them with node->release(). The bias exceeds any ticket count,
+		//    so readers releasing before the writer has traded it cannot free the node.
+		template<typename P>
+		class sp_atomic_slot
+		{
+			typedef sp_counted_impl_pdi<P> node_type;
+
+			static_assert(sizeof(void*) == 8, "sp_atomic_slot packs a 48-bit address into a 64-bit word");
+			static constexpr std::uint64_t ticket_one = std::uint64_t(1) << 48;
+			static constexpr std::uint64_t ptr_mask = ticket_one - 1;
+			static constexpr long reference_bias = long(1) << 16;
+		public:
+			constexpr sp_atomic_slot() noexcept : m_word(0) {}
+
+			explicit sp_atomic_slot(P desired) : m_word(make_word(std::move(desired))) {}
+
+			sp_atomic_slot(sp_atomic_slot const&) = delete;
+			sp_atomic_slot& operator=(sp_atomic_slot const&) = delete;
+
+			~sp_atomic_slot()
+			{
+				release_word(m_word.load(std::memory_order_acquire));
+			}
+
+			bool is_lock_free() const noexcept
+			{
+				return m_word.is_lock_free();
+			}
+
+			P load() const noexcept
+			{
+				std::uint64_t cur = m_word.fetch_add(ticket_one, std::memory_order_acquire) + ticket_one;
+				node_type* node = node_of(cur);
+				P ret = node != nullptr ? *node->get() : P();
+				release_ticket(cur);
+				return ret;
+			}
+
+			void store(P desired)
+			{
+				release_word(m_word.exchange(make_word(std::move(desired)), std::memory_order_acq_rel));
+			}
+
+			P exchange(P desired)
+			{
+				std::uint64_t old = m_word.exchange(make_word(std::move(desired)), std::memory_order_acq_rel);
+				node_type* node = node_of(old);
+				// readers holding tickets may still be copying the value, so copy rather than move
+				P ret = node != nullptr ? *node->get() : P();
+				release_word(old);
+				return ret;
+			}
+
+			bool compare_exchange(P& expected, P desired)
+			{
+				std::uint64_t next = 0;
+				bool next_built = false;
+				for (;;)
+				{
+					std::uint64_t cur = m_word.fetch_add(ticket_one, std::memory_order_acquire) + ticket_one;
+					node_type* node = node_of(cur);
+					P const& current = node != nullptr ? *node->get() : empty_value();
+					if (!same_owner(current, expected))
+					{
+						expected = current;
+						release_ticket(cur);
+						if (next_built)
+						{
+							release_word(next);
+						}
+						return false;
+					}
+
+					if (!next_built)
+					{
+						next = make_word(std::move(desired));
+						next_built = true;
+					}
+
+					while (node_of(cur) == node)
+					{
+						if (m_word.compare_exchange_weak(cur, next, std::memory_order_acq_rel, std::memory_order_relaxed))
+						{
+							// our own ticket goes away together with the slot's bias
+							if (node != nullptr)
+							{
+								hand_over(node, (cur >> 48) - 1);
+							}
+							return true;
+						}
+					}
+
+					// another writer replaced the node and turned our ticket into a reference
+					if (node != nullptr)
+					{
+						node->release();
+					}
+				}
+			}
+		private:
+			static node_type* node_of(std::uint64_t word) noexcept
+			{
+				return reinterpret_cast<node_type*>(static_cast<std::uintptr_t>(word & ptr_mask));
+			}
+
+			static std::uint64_t make_word(P desired)
+			{
+				if (desired.px == nullptr && desired.pn == nullptr)
+				{
+					return 0;
+				}
+				node_type* node = new node_type(std::move(desired));
+				node->add_ref_copy(reference_bias - 1);
+				return static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(node));
+			}
+
+			static bool same_owner(P const& a, P const& b) noexcept
+			{
+				return a.px == b.px && a.pn == b.pn;
+			}
+
+			static P const& empty_value() noexcept
+			{
+				static P const empty = P();
+				return empty;
+			}
+
+			// drop a word that has been swapped out of m_word
+			static void release_word(std::uint64_t word) noexcept
+			{
+				node_type* node = node_of(word);
+				if (node == nullptr)
+				{
+					return;
+				}
+				hand_over(node, word >> 48);
+			}
+
+			// the slot's bias on node becomes one reference per outstanding ticket; one
+			// subtraction, so the count never passes through zero while tickets remain
+			static void hand_over(node_type* node, std::uint64_t tickets) noexcept
+			{
+				node->release(reference_bias - static_cast<long>(tickets));
+			}
+
+			// give back the ticket taken on seen; the count guard keeps tickets taken on an
+			// empty word (which no writer accounts for) from underflowing a fresh one
+			void release_ticket(std::uint64_t seen) const noexcept
+			{
+				std::uint64_t cur = m_word.load(std::memory_order_relaxed);
+				while ((cur & ptr_mask) == (seen & ptr_mask) && (cur >> 48) != 0)
+				{
+					if (m_word.compare_exchange_weak(cur, cur - ticket_one, std::memory_order_release, std::memory_order_relaxed))
+					{
+						return;
+					}
+				}
+				if (node_type* node = node_of(seen))
+				{
+					node->release();
+				}
+			}
+		private:
+			mutable std::atomic<std::uint64_t> m_word;
+		};
+
+		template<typename T>
+		class atomic_shared_ptr
+		{
+		public:
+			constexpr atomic_shared_ptr() noexcept = default;
+
+			atomic_shared_ptr(shared_ptr<T> desired) : slot(std::move(desired)) {}
+
+			atomic_shared_ptr(atomic_shared_ptr const&) = delete;
+			atomic_shared_ptr& operator=(atomic_shared_ptr const&) = delete;
+
+			atomic_shared_ptr& operator=(shared_ptr<T> desired)
+			{
+				slot.store(std::move(desired));
+				return *this;
+			}
+
+			bool is_lock_free() const noexcept
+			{
+				return slot.is_lock_free();
+			}
+
+			shared_ptr<T> load() const noexcept
+			{
+				return slot.load();
+			}
+
+			operator shared_ptr<T>() const noexcept
+			{
+				return slot.load();
+			}
+
+			void store(shared_ptr<T> desired)
+			{
+				slot.store(std::move(desired));
+			}
+
+			shared_ptr<T> exchange(shared_ptr<T> desired)
+			{
+				return slot.exchange(std::move(desired));
+			}
+
+			bool compare_exchange_weak(shared_ptr<T>& expected, shared_ptr<T> desired)
+			{
+				return slot.compare_exchange(expected, std::move(desired));
+			}
+
+			bool compare_exchange_strong(shared_ptr<T>& expected, shared_ptr<T> desired)
+			{
+				return slot.compare_exchange(expected, std::move(desired));
+			}
+		private:
+			sp_atomic_slot<shared_ptr<T>> slot;
+		};
+
+		template<typename T>
+		class atomic_weak_ptr
+		{
+		public:
+			constexpr atomic_weak_ptr() noexcept = default;
+
+			atomic_weak_ptr(weak_ptr<T> desired) : slot(std::move(desired)) {}
+
+			atomic_weak_ptr(atomic_weak_ptr const&) = delete;
+			atomic_weak_ptr& operator=(atomic_weak_ptr const&) = delete;
+
+			atomic_weak_ptr& operator=(weak_ptr<T> desired)
+			{
+				slot.store(std::move(desired));
+				return *this;
+			}
+
+			bool is_lock_free() const noexcept
+			{
+				return slot.is_lock_free();
+			}
+
+			weak_ptr<T> load() const noexcept
+			{
+				return slot.load();
+			}
+
+			operator weak_ptr<T>() const noexcept
+			{
+				return slot.load();
+			}
+
+			void store(weak_ptr<T> desired)
+			{
+				slot.store(std::move(desired));
+			}
+
+			weak_ptr<T> exchange(weak_ptr<T> desired)
+			{
+				return slot.exchange(std::move(desired));
+			}
+
+			bool compare_exchange_weak(weak_ptr<T>& expected, weak_ptr<T> desired)
+			{
+				return slot.compare_exchange(expected, std::move(desired));
+			}
+
+			bool compare_exchange_strong(weak_ptr<T>& expected, weak_ptr<T> desired)
+			{
+				return slot.compare_exchange(expected, std::move(desired));
+			}
+		private:
+			sp_atomic_slot<weak_ptr<T>> slot;
+		};
+
+//-------------------epoch reclamation---------------------------------
+		// sp_epoch_domain: process-wide epoch-based reclamation. Readers announce the
+		// epoch they entered in a per-thread record (no shared cache line is written),
+		// retired control blocks get their release() deferred until every reader that
+		// was active when they were retired has left.
+		class sp_epoch_domain
+		{
+		public:
+			static void enter() noexcept;
+			static void leave() noexcept;
+			// drop one strong reference on pn once no current reader can still see it
+			static void retire(sp_counted_base* pn);
+			// release whatever is safe now and advance the epoch
+			static void collect();
+			// release everything retired so far; must not be called inside a guard
+			static void synchronize();
+		};
+
+		// sp_epoch_guard: readers stay inside the current epoch while it is alive
+		class sp_epoch_guard
+		{
+		public:
+			sp_epoch_guard() noexcept
+			{
+				sp_epoch_domain::enter();
+			}
+
+			~sp_epoch_guard() noexcept
+			{
+				sp_epoch_domain::leave();
+			}
+
+			sp_epoch_guard(sp_epoch_guard const&) = delete;
+			sp_epoch_guard& operator=(sp_epoch_guard const&) = delete;
+		};
+
+		// guarded_shared_ptr<T>: owns an object through a shared_ptr<T> and lets readers
+		// under an sp_epoch_guard look at it without touching any reference count.
+		// Replacing the object retires the old owner into sp_epoch_domain.
+		template<typename T>
+		class guarded_shared_ptr
+		{
+			typedef sp_counted_impl_pdi<shared_ptr<T>> node_type;
+		public:
+			typedef typename detail::sp_element<T>::type element_type;
+
+			constexpr guarded_shared_ptr() noexcept : m_node(nullptr) {}
+
+			explicit guarded_shared_ptr(shared_ptr<T> p) : m_node(make_node(std::move(p))) {}
+
+			guarded_shared_ptr(guarded_shared_ptr const&) = delete;
+			guarded_shared_ptr& operator=(guarded_shared_ptr const&) = delete;
+
+			~guarded_shared_ptr()
+			{
+				if (node_type* node = m_node.load(std::memory_order_acquire))
+				{
+					sp_epoch_domain::retire(node);
+				}
+			}
+
+			void store(shared_ptr<T> p)
+			{
+				node_type* old = m_node.exchange(make_node(std::move(p)), std::memory_order_seq_cst);
+				if (old != nullptr)
+				{
+					sp_epoch_domain::retire(old);
+				}
+			}
+
+			// non-owning view, valid until guard is destroyed
+			element_type* get(sp_epoch_guard const&) const noexcept
+			{
+				node_type* node = m_node.load(std::memory_order_seq_cst);
+				return node != nullptr ? node->get()->get() : nullptr;
+			}
+
+			// promote the guarded view to a full owner
+			shared_ptr<T> lock(sp_epoch_guard const&) const noexcept
+			{
+				node_type* node = m_node.load(std::memory_order_seq_cst);
+				return node != nullptr ? *node->get() : shared_ptr<T>();
+			}
+		private:
+			static node_type* make_node(shared_ptr<T> p)
+			{
+				return p ? new node_type(std::move(p)) : nullptr;
+			}
+		private:
+			std::atomic<node_type*> m_node;
+		};
+
+//-------------------deferred destruction---------------------------------
+		// sp_deferred_reclaimer: background thread that runs object teardown handed off by
+		// latency-critical threads. Producers push onto a bounded lock-free queue; when it is
+		// full the task runs inline on the producer, which bounds memory and pushes back
+		// on threads that release faster than the reclaimer can keep up.
+		class sp_deferred_reclaimer
+		{
+		public:
+			typedef void (*task_fn)(void*);
+			static constexpr std::size_t capacity = 4096;
+
+			static void post(task_fn fn, void* arg);
+			// block until every task posted before the call has run; use before shutdown
+			static void drain();
+		};
+
+		// deferred_delete<T>: deleter for shared_ptr(p, d) / unique_ptr that deletes on the reclaimer thread
+		template<typename T>
+		struct deferred_delete
+		{
+			void operator()(T* p) const
+			{
+				if (p != nullptr)
+				{
+					sp_deferred_reclaimer::post(&run, const_cast<void*>(static_cast<void const*>(p)));
+				}
+			}
+		private:
+			static void run(void* p)
+			{
+				delete static_cast<T*>(p);
+			}
+		};
+
+		//----------------------------------------------------------
+		// Inline storage whose dispose (and destroy, if no weak_ptr is left) runs on the reclaimer thread
+		template<typename T>
+		class sp_counted_impl_pdi_deferred final : public sp_counted_base
+		{
+		public:
+			template<typename... Args>
+			explicit sp_counted_impl_pdi_deferred(Args&&... args)
+			{
+				::new (static_cast<void*>(&storage_block)) T(std::forward<Args>(args)...);
+				sp_stats_bind<T>(this, sizeof(*this));
+			}
+
+			virtual void dispose() override
+			{
+				// weak_ptrs remain: keep the block alive until the background dispose is done
+				weak_add_ref();
+				sp_deferred_reclaimer::post(&run_dispose, this);
+			}
+
+			virtual void destroy() override
+			{
+				delete this;
+			}
+
+			virtual void dispose_destroy() override
+			{
+				sp_deferred_reclaimer::post(&run_dispose_destroy, this);
+			}
+
+			T* get() const noexcept
+			{
+				return const_cast<T*>(reinterpret_cast<T const*>(&storage_block));
+			}
+		private:
+			static void run_dispose(void* p)
+			{
+				sp_counted_impl_pdi_deferred* self = static_cast<sp_counted_impl_pdi_deferred*>(p);
+				self->get()->~T();
+				self->weak_release();
+			}
+
+			static void run_dispose_destroy(void* p)
+			{
+				sp_counted_impl_pdi_deferred* self = static_cast<sp_counted_impl_pdi_deferred*>(p);
+				self->get()->~T();
+				delete self;
+			}
+
+			typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage_block;
+		};
+
+		//make_shared_deferred: make_shared whose last release hands teardown to sp_deferred_reclaimer
+		template<typename T, typename... Args>
+		shared_ptr<T> make_shared_deferred(Args&&... args)
+		{
+			typedef typename std::remove_cv<T>::type T_ncv;
+			sp_counted_impl_pdi_deferred<T_ncv>* pi = new sp_counted_impl_pdi_deferred<T_ncv>(std::forward<Args>(args)...);
+			shared_ptr<T> Ret = sp_adopt_block<T>(pi->get(), pi);
+			sp_enable_shared_from_this(&Ret, Ret.get(), Ret.get());
+			return Ret;
+		}
+
+//-------------------biased reference counting---------------------------------
+		// sp_counted_biased: strong count split between the creating (owner) thread, which
+		// counts with plain loads and stores, and everybody else, who share an atomic count.
+		// References move freely between threads; when a non-owner release may have taken
+		// the shared side to zero or below, it asks the owner to merge the two halves. The
+		// owner serves such requests on its next biased operation, in flush(), or when the
+		// thread exits, so an idle owner thread should call flush() from its event loop.
+		class sp_counted_biased : public sp_counted_base
+		{
+		public:
+			// serve pending merge requests for objects created by the calling thread
+			static void flush();
+		protected:
+			sp_counted_biased();
+			~sp_counted_biased();
+
+			virtual void delegated_add_ref() override;
+			virtual bool delegated_release() override;
+			virtual bool delegated_add_ref_lock() override;
+			virtual long delegated_use_count() const override;
+		private:
+			struct owner_state;
+			static owner_state* current_owner();
+
+			bool is_owner_local() const;
+			bool merge();
+			void request_merge();
+		private:
+			owner_state* m_owner;                   // null for blocks created after the thread retired
+			std::atomic<long> m_local;              // written by the owner thread only; read racily by use_count,
+			                                        // and by lock once the shared side drains
+			std::atomic<std::int64_t> m_shared;     // 2 * shared count + merged bit; the shared count starts at
+			                                        // 1 on behalf of the owner's local references
+			std::atomic<bool> m_merge_requested;
+			bool m_merged;                          // owner thread only
+			sp_counted_biased* m_request_next;
+			sp_counted_biased* m_prev;              // owner's list of unmerged blocks
+			sp_counted_biased* m_next;
+		};
+
+		//----------------------------------------------------------
+		// Inline storage with biased counting（make_shared_biased）
+		template<typename T>
+		class sp_counted_impl_pdi_biased final : public sp_counted_biased
+		{
+		public:
+			template<typename... Args>
+			explicit sp_counted_impl_pdi_biased(Args&&... args)
+			{
+				::new (static_cast<void*>(&storage_block)) T(std::forward<Args>(args)...);
+				sp_stats_bind<T>(this, sizeof(*this));
+			}
+
+			virtual void dispose() override
+			{
+				get()->~T();
+			}
+
+			virtual void destroy() override
+			{
+				delete this;
+			}
+
+			T* get() const noexcept
+			{
+				return const_cast<T*>(reinterpret_cast<T const*>(&storage_block));
+			}
+		private:
+			typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage_block;
+		};
+
+		//make_shared_biased: copies made on the calling thread cost no atomic operation
+		template<typename T, typename... Args>
+		shared_ptr<T> make_shared_biased(Args&&... args)
+		{
+			typedef typename std::remove_cv<T>::type T_ncv;
+			sp_counted_impl_pdi_biased<T_ncv>* pi = new sp_counted_impl_pdi_biased<T_ncv>(std::forward<Args>(args)...);
+			shared_ptr<T> Ret = sp_adopt_block<T>(pi->get(), pi);
+			sp_enable_shared_from_this(&Ret, Ret.get(), Ret.get());
+			return Ret;
+		}
+
+//-------------------sharded reference counting---------------------------------
+		// sp_counted_sharded: strong count spread over cache-line sized slots, one per
+		// group of threads, plus a central slot that starts with the creator's reference.
+		// A copy touches only the caller's slot. A release takes from the caller's slot
+		// when it has something to give, otherwise from the central slot. A global
+		// reconciliation (a versioned double collect of all slots) is needed only when the
+		// central slot is exhausted; it then folds the per-thread slots back into the
+		// central one, so the common case stays on per-thread cache lines.
+		class sp_counted_sharded : public sp_counted_base
+		{
+		public:
+			static constexpr std::size_t shard_count = 16;
+		protected:
+			sp_counted_sharded();
+
+			virtual void delegated_add_ref() override;
+			virtual bool delegated_release() override;
+			virtual bool delegated_add_ref_lock() override;
+			virtual long delegated_use_count() const override;
+		private:
+			// version in the high 32 bits, signed count in the low 32 bits
+			struct alignas(64) shard
+			{
+				std::atomic<std::uint64_t> word;
+			};
+
+			bool reconcile();
+			void rebalance();
+			void lock_reconcile();
+			void unlock_reconcile();
+		private:
+			shard m_central;
+			shard m_shards[shard_count];
+			std::atomic<bool> m_reconciling;
+			bool m_dead;
+		};
+
+		//----------------------------------------------------------
+		// Inline storage with sharded counting（make_shared_sharded）
+		template<typename T>
+		class sp_counted_impl_pdi_sharded final : public sp_counted_sharded
+		{
+		public:
+			template<typename... Args>
+			explicit sp_counted_impl_pdi_sharded(Args&&... args)
+			{
+				::new (static_cast<void*>(&storage_block)) T(std::forward<Args>(args)...);
+				sp_stats_bind<T>(this, sizeof(*this));
+			}
+
+			virtual void dispose() override
+			{
+				get()->~T();
+			}
+
+			virtual void destroy() override
+			{
+				delete this;
+			}
+
+			T* get() const noexcept
+			{
+				return const_cast<T*>(reinterpret_cast<T const*>(&storage_block));
+			}
+		private:
+			typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage_block;
+		};
+
+		//make_shared_sharded: for a few hot objects copied by every thread; costs about 1 KB of counts
+		template<typename T, typename... Args>
+		shared_ptr<T> make_shared_sharded(Args&&... args)
+		{
+			typedef typename std::remove_cv<T>::type T_ncv;
+			sp_counted_impl_pdi_sharded<T_ncv>* pi = new sp_counted_impl_pdi_sharded<T_ncv>(std::forward<Args>(args)...);
+			shared_ptr<T> Ret = sp_adopt_block<T>(pi->get(), pi);
+			sp_enable_shared_from_this(&Ret, Ret.get(), Ret.get());
+			return Ret;
+		}
 
+//-------------------local_shared_ptr---------------------------------
+		// local_shared_ptr / local_weak_ptr: shared_ptr / weak_ptr for objects that are
+		// only ever owned from one thread. Counts are plain integers, so copies cost no
+		// locked instructions. There is no conversion to or from shared_ptr.
 		template<typename T>
-		class shared_ptr
+		class local_shared_ptr
 		{
 			typedef typename detail::sp_element<T>::type element_type;
-			//using element_type = detail::sp_element<T>::type;
-			template<typename Y> friend class shared_ptr;
-			template<typename Y> friend class weak_ptr;
+			template<typename Y> friend class local_shared_ptr;
+			template<typename Y> friend class local_weak_ptr;
 		public:
-			using types=  typename shared_ptr<T>::element_type;
-			constexpr shared_ptr() noexcept = default;
+			using types = typename local_shared_ptr<T>::element_type;
+			constexpr local_shared_ptr() noexcept : px(nullptr), pn(nullptr) {}
+
+			constexpr local_shared_ptr(std::nullptr_t) noexcept : px(nullptr), pn(nullptr) {}
 
-			constexpr shared_ptr(nullptr_t) noexcept {} // construct empty shared_ptr
 			template<typename Y>
-			explicit shared_ptr(Y* p) noexcept : px(p), pn(nullptr)
+			explicit local_shared_ptr(Y* p) : px(p), pn(nullptr)
 			{
 				try
 				{
-					pn = new sp_counted_impl_p<Y>(p);
+					pn = new sp_counted_impl_p<Y, local_sp_counted_base>(p);
 				}
 				catch (...)
 				{
@@ -302,11 +2742,11 @@ namespace utils
 			}
 
 			template<typename Y, typename D>
-			shared_ptr(Y* p, D d) noexcept  : px(p), pn(nullptr)
+			local_shared_ptr(Y* p, D d) : px(p), pn(nullptr)
 			{
 				try
 				{
-					pn = new sp_counted_impl_pd<Y, D>(p, std::move(d));
+					pn = new sp_counted_impl_pd<Y, D, local_sp_counted_base>(p, d);
 				}
 				catch (...)
 				{
@@ -316,7 +2756,7 @@ namespace utils
 			}
 
 			//copy constructor
-			shared_ptr(shared_ptr const& r) noexcept : px(r.px), pn(r.pn)
+			local_shared_ptr(local_shared_ptr const& r) noexcept : px(r.px), pn(r.pn)
 			{
 				if (pn != nullptr)
 				{
@@ -325,22 +2765,26 @@ namespace utils
 			}
 
 			template<typename Y>
-			shared_ptr(shared_ptr<Y> const& r) noexcept : px(r.px), pn(r.pn)
+			local_shared_ptr(local_shared_ptr<Y> const& r) noexcept : px(r.px), pn(r.pn)
 			{
-				if (pn != nullptr) {
+				if (pn != nullptr)
+				{
 					pn->add_ref_copy();
 				}
 			}
 
+			template<typename Y>
+			local_shared_ptr(shared_ptr<Y> const& r) = delete;
+
 			// move constructor
-			shared_ptr(shared_ptr&& r) noexcept  : px(r.px), pn(std::move(r).pn)
+			local_shared_ptr(local_shared_ptr&& r) noexcept : px(r.px), pn(r.pn)
 			{
 				r.px = nullptr;
 				r.pn = nullptr;
 			}
 
 			template<typename Y>
-			shared_ptr(shared_ptr<Y>&& r) noexcept  : px(r.px), pn(std::move(r).pn)
+			local_shared_ptr(local_shared_ptr<Y>&& r) noexcept : px(r.px), pn(r.pn)
 			{
 				r.px = nullptr;
 				r.pn = nullptr;
@@ -348,7 +2792,7 @@ namespace utils
 
 			// Alias constructor
 			template<typename Y>
-			shared_ptr(shared_ptr<Y> const& r, element_type* p) noexcept  : px(p), pn(r.pn)
+			local_shared_ptr(local_shared_ptr<Y> const& r, element_type* p) noexcept : px(p), pn(r.pn)
 			{
 				if (pn != nullptr)
 				{
@@ -356,16 +2800,8 @@ namespace utils
 				}
 			}
 
-			template<typename Y>
-			shared_ptr(shared_ptr<Y> const&& r, element_type* p) noexcept  : px(p), pn(std::move(r).pn)
-			{
-				if (pn != nullptr)
-				{
-					pn->add_ref_copy();
-				}
-			}
 			// destructor
-			~shared_ptr() noexcept
+			~local_shared_ptr() noexcept
 			{
 				if (pn != nullptr)
 				{
@@ -373,7 +2809,7 @@ namespace utils
 				}
 			}
 
-			void swap(shared_ptr& other) noexcept
+			void swap(local_shared_ptr& other) noexcept
 			{
 				std::swap(px, other.px);
 				std::swap(pn, other.pn);
@@ -382,19 +2818,19 @@ namespace utils
 			// reset
 			void reset() noexcept
 			{
-				shared_ptr().swap(*this);
+				local_shared_ptr().swap(*this);
 			}
 
 			template<typename Y>
 			void reset(Y* p)
 			{
-				shared_ptr(p).swap(*this);
+				local_shared_ptr(p).swap(*this);
 			}
 
 			template<typename Y, typename D>
 			void reset(Y* p, D d)
 			{
-				shared_ptr(p, d).swap(*this);
+				local_shared_ptr(p, d).swap(*this);
 			}
 
 			// observer
@@ -403,7 +2839,7 @@ namespace utils
 				return *px;
 			}
 
-			element_type* operator->() const  noexcept
+			element_type* operator->() const noexcept
 			{
 				return px;
 			}
@@ -429,263 +2865,522 @@ namespace utils
 			}
 
 			// Assignment operation
-			shared_ptr& operator=(shared_ptr const& r) noexcept
+			local_shared_ptr& operator=(local_shared_ptr const& r) noexcept
 			{
-				shared_ptr(r).swap(*this);
+				local_shared_ptr(r).swap(*this);
 				return *this;
 			}
 
 			template<typename Y>
-			shared_ptr& operator=(shared_ptr<Y> const& r) noexcept
+			local_shared_ptr& operator=(local_shared_ptr<Y> const& r) noexcept
 			{
-				shared_ptr(r).swap(*this);
+				local_shared_ptr(r).swap(*this);
 				return *this;
 			}
 
-			shared_ptr& operator=(shared_ptr&& r) noexcept
+			local_shared_ptr& operator=(local_shared_ptr&& r) noexcept
 			{
-				shared_ptr(std::move(r)).swap(*this);
+				local_shared_ptr(std::move(r)).swap(*this);
 				return *this;
 			}
 
 			template<typename Y>
-			shared_ptr& operator=(shared_ptr<Y>&& r) noexcept
+			local_shared_ptr& operator=(local_shared_ptr<Y>&& r) noexcept
 			{
-				shared_ptr(std::move(r)).swap(*this);
+				local_shared_ptr(std::move(r)).swap(*this);
 				return *this;
 			}
 		private:
-			template<typename T, typename... Args>
-			friend shared_ptr<T> make_shared(Args&&... _Args)noexcept(std::is_nothrow_constructible_v<T, Args...>);
-			void  set_ptr_rep(element_type* px, sp_counted_base* p)
+			template<typename Y, typename... Args>
+			friend local_shared_ptr<Y> make_local_shared(Args&&... args);
+			void set_ptr_rep(element_type* px, local_sp_counted_base* p)
 			{
 				this->px = px;
 				this->pn = p;
 			}
 		private:
 			element_type* px;
-			sp_counted_base* pn;
-
+			local_sp_counted_base* pn;
 		};
 
 		// comparison operator
 		template<typename T, typename U>
-		inline bool operator==(shared_ptr<T> const& Lv, shared_ptr<U> const& Rv) noexcept
+		inline bool operator==(local_shared_ptr<T> const& Lv, local_shared_ptr<U> const& Rv) noexcept
 		{
 			return Lv.get() == Rv.get();
 		}
 
 		template<typename T, typename U>
-		inline bool operator!=(shared_ptr<T> const& Lv, shared_ptr<U> const& Rv) noexcept
+		inline bool operator!=(local_shared_ptr<T> const& Lv, local_shared_ptr<U> const& Rv) noexcept
 		{
-			return  Lv.get() != Rv.get();
+			return Lv.get() != Rv.get();
 		}
 
 		template<typename T, typename U>
-		inline bool operator<(shared_ptr<T> const& Lv, shared_ptr<U> const& Rv) noexcept
+		inline bool operator<(local_shared_ptr<T> const& Lv, local_shared_ptr<U> const& Rv) noexcept
 		{
 			return std::less<typename std::common_type<T*, U*>::type>()(Lv.get(), Rv.get());
 		}
 
-		template<typename T, typename U>
-		inline bool operator<=(shared_ptr<T> const& Lv, shared_ptr<U> const& Rv) noexcept
-		{
-			return !(Rv.get() < Lv.get());
-		}
-
-		template<typename T, typename U>
-		inline bool operator>(shared_ptr<T> const& Lv, shared_ptr<U> const& Rv) noexcept
-		{
-			return Rv.get() < Lv.get();
-		}
-
-		template<typename T, typename U>
-		inline bool operator>=(shared_ptr<T> const& Lv, shared_ptr<U> const& Rv) noexcept
-		{
-			return !(Lv.get() < Rv.get());
-		}
-
 		// A family of type conversion functions
 		template<typename T, typename U>
-		shared_ptr<T> static_pointer_cast(shared_ptr<U> const& r) noexcept
+		local_shared_ptr<T> static_pointer_cast(local_shared_ptr<U> const& r) noexcept
 		{
 			(void) static_cast<T*>(static_cast<U*>(0));
-			typedef typename shared_ptr<T>::types E;
+			typedef typename local_shared_ptr<T>::types E;
 			E* p = static_cast<E*>(r.get());
-			return shared_ptr<T>(r, p);
+			return local_shared_ptr<T>(r, p);
 		}
 
 		template<typename T, typename U>
-		shared_ptr<T> dynamic_pointer_cast(shared_ptr<U> const& r) noexcept
+		local_shared_ptr<T> dynamic_pointer_cast(local_shared_ptr<U> const& r) noexcept
 		{
 			(void) dynamic_cast<T*>(static_cast<U*>(0));
-			typedef typename shared_ptr<T>::types E;
+			typedef typename local_shared_ptr<T>::types E;
 			E* p = dynamic_cast<E*>(r.get());
-			return p ? shared_ptr<T>(r, p) : shared_ptr<T>();
+			return p ? local_shared_ptr<T>(r, p) : local_shared_ptr<T>();
 		}
 
 		template<typename T, typename U>
-		shared_ptr<T> const_pointer_cast(shared_ptr<U> const& r) noexcept
+		local_shared_ptr<T> const_pointer_cast(local_shared_ptr<U> const& r) noexcept
 		{
 			(void) const_cast<T*>(static_cast<U*>(0));
-			typedef typename shared_ptr<T>::types E;
+			typedef typename local_shared_ptr<T>::types E;
 			E* p = const_cast<E*>(r.get());
-			return shared_ptr<T>(r, p);
+			return local_shared_ptr<T>(r, p);
 		}
 
-		//make_shared
-
+		//make_local_shared
 		template<typename T, typename... Args>
-		shared_ptr<T> make_shared(Args&&... args)noexcept(std::is_nothrow_constructible_v<T, Args...>)
+		local_shared_ptr<T> make_local_shared(Args&&... args)
 		{
-			typedef typename   std::remove_cv<T>::type  T_ncv;
-			sp_counted_impl_pdi<T_ncv>* pi = new sp_counted_impl_pdi<T_ncv>(std::forward<Args>(args)...);
-			shared_ptr<T> Ret;
+			typedef typename std::remove_cv<T>::type T_ncv;
+			sp_counted_impl_pdi<T_ncv, local_sp_counted_base>* pi = new sp_counted_impl_pdi<T_ncv, local_sp_counted_base>(std::forward<Args>(args)...);
+			local_shared_ptr<T> Ret;
 			Ret.set_ptr_rep(pi->get(), pi);
 			return Ret;
 		}
 
-//-------------------weak_ptr---------------------------------
+//-------------------local_weak_ptr---------------------------------
 		template<typename T>
-		class weak_ptr
+		class local_weak_ptr
 		{
-			template<typename Y> friend class weak_ptr;
-			template<typename Y> friend class shared_ptr;
+			template<typename Y> friend class local_weak_ptr;
+			template<typename Y> friend class local_shared_ptr;
 		public:
 			// constructor
-			constexpr weak_ptr() : px(nullptr), pn(nullptr) {}
+			constexpr local_weak_ptr() noexcept : px(nullptr), pn(nullptr) {}
 
 			template<typename Y>
-			weak_ptr(shared_ptr<Y> const& r) noexcept  : px(r.px), pn(r.pn)
+			local_weak_ptr(local_shared_ptr<Y> const& r) noexcept : px(r.px), pn(r.pn)
 			{
-				if (pn != nullptr) 
+				if (pn != nullptr)
 				{
 					pn->weak_add_ref();
 				}
 			}
 
 			// copy constructor
-			weak_ptr(weak_ptr const& r) noexcept : px(r.px), pn(r.pn)
+			local_weak_ptr(local_weak_ptr const& r) noexcept : px(r.px), pn(r.pn)
 			{
-				if (pn != nullptr) 
+				if (pn != nullptr)
 				{
 					pn->weak_add_ref();
 				}
 			}
 
 			template<typename Y>
-			weak_ptr(weak_ptr<Y> const& r) noexcept : px(r.lock().get()), pn(r.pn)
+			local_weak_ptr(local_weak_ptr<Y> const& r) noexcept : px(r.lock().get()), pn(r.pn)
 			{
-				if (pn != nullptr) 
+				if (pn != nullptr)
 				{
 					pn->weak_add_ref();
 				}
 			}
 
 			// move constructor
-			weak_ptr(weak_ptr&& r) noexcept  : px(r.px), pn(r.pn)
+			local_weak_ptr(local_weak_ptr&& r) noexcept : px(r.px), pn(r.pn)
 			{
 				r.px = nullptr;
 				r.pn = nullptr;
 			}
 
+			// Assignment operation
+			local_weak_ptr& operator=(local_weak_ptr const& r) noexcept
+			{
+				local_weak_ptr(r).swap(*this);
+				return *this;
+			}
+
 			template<typename Y>
-			weak_ptr(weak_ptr<Y>&& r) noexcept  : px(r.px), pn(r.pn)
+			local_weak_ptr& operator=(local_shared_ptr<Y> const& r) noexcept
 			{
-				r.px = nullptr;
-				r.pn = nullptr;
+				local_weak_ptr(r).swap(*this);
+				return *this;
 			}
 
-			// Assignment operation
-			weak_ptr& operator=(weak_ptr const& r) noexcept
+			local_weak_ptr& operator=(local_weak_ptr&& r) noexcept
 			{
-				weak_ptr(r).swap(*this);
+				local_weak_ptr(std::move(r)).swap(*this);
 				return *this;
 			}
 
-			template<typename Y>
-			weak_ptr& operator=(weak_ptr<Y> const& r) noexcept
+			// destrouctor
+			~local_weak_ptr() noexcept
 			{
-				weak_ptr(r).swap(*this);
+				if (pn != nullptr)
+				{
+					pn->weak_release();
+				}
+			}
+
+			// reset
+			void reset() noexcept
+			{
+				local_weak_ptr().swap(*this);
+			}
+
+			// swap
+			void swap(local_weak_ptr& other) noexcept
+			{
+				std::swap(px, other.px);
+				std::swap(pn, other.pn);
+			}
+
+			// observer
+			long use_count() const noexcept
+			{
+				return pn ? pn->use_count() : 0;
+			}
+
+			bool expired() const noexcept
+			{
+				return use_count() == 0;
+			}
+
+			local_shared_ptr<T> lock() const noexcept
+			{
+				if (expired())
+				{
+					return local_shared_ptr<T>();
+				}
+
+				local_shared_ptr<T> p;
+				p.px = px;
+				p.pn = pn;
+				pn->add_ref_lock();
+				return p;
+			}
+		private:
+			typedef typename detail::sp_element<T>::type element_type;
+			element_type* px;
+			local_sp_counted_base* pn;
+		};
+
+//-------------------intrusive_ptr---------------------------------
+		// counter policies for intrusive_ref_counter
+		struct thread_safe_counter
+		{
+			typedef std::atomic<long> type;
+
+			static long load(type const& counter) noexcept
+			{
+				return counter.load(std::memory_order_relaxed);
+			}
+
+			static void increment(type& counter) noexcept
+			{
+				counter.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			// returns the new value
+			static long decrement(type& counter) noexcept
+			{
+				return counter.fetch_sub(1, std::memory_order_acq_rel) - 1;
+			}
+		};
+
+		struct thread_unsafe_counter
+		{
+			typedef long type;
+
+			static long load(type const& counter) noexcept
+			{
+				return counter;
+			}
+
+			static void increment(type& counter) noexcept
+			{
+				++counter;
+			}
+
+			static long decrement(type& counter) noexcept
+			{
+				return --counter;
+			}
+		};
+
+		// intrusive_ref_counter<T, Policy>: base class that embeds the reference count
+		// in T, for use with intrusive_ptr<T>. T is deleted through T*, so a hierarchy
+		// needs a virtual destructor in T.
+		template<typename T, typename Policy = thread_safe_counter>
+		class intrusive_ref_counter
+		{
+		public:
+			long use_count() const noexcept
+			{
+				return Policy::load(m_ref_count);
+			}
+		protected:
+			constexpr intrusive_ref_counter() noexcept : m_ref_count(0) {}
+
+			// the count belongs to the object, not to its value
+			intrusive_ref_counter(intrusive_ref_counter const&) noexcept : m_ref_count(0) {}
+
+			intrusive_ref_counter& operator=(intrusive_ref_counter const&) noexcept
+			{
+				return *this;
+			}
+
+			~intrusive_ref_counter() = default;
+		private:
+			friend void intrusive_ptr_add_ref(intrusive_ref_counter const* p) noexcept
+			{
+				Policy::increment(p->m_ref_count);
+			}
+
+			friend void intrusive_ptr_release(intrusive_ref_counter const* p) noexcept
+			{
+				if (Policy::decrement(p->m_ref_count) == 0)
+				{
+					delete static_cast<T const*>(p);
+				}
+			}
+
+			mutable typename Policy::type m_ref_count;
+		};
+
+		// intrusive_ptr<T>: one pointer wide, counts through the ADL functions
+		// intrusive_ptr_add_ref(T*) and intrusive_ptr_release(T*)
+		template<typename T>
+		class intrusive_ptr
+		{
+			template<typename Y> friend class intrusive_ptr;
+		public:
+			typedef T element_type;
+
+			constexpr intrusive_ptr() noexcept : px(nullptr) {}
+
+			constexpr intrusive_ptr(std::nullptr_t) noexcept : px(nullptr) {}
+
+			intrusive_ptr(T* p, bool add_ref = true) : px(p)
+			{
+				if (px != nullptr && add_ref)
+				{
+					intrusive_ptr_add_ref(px);
+				}
+			}
+
+			//copy constructor
+			intrusive_ptr(intrusive_ptr const& r) : px(r.px)
+			{
+				if (px != nullptr)
+				{
+					intrusive_ptr_add_ref(px);
+				}
+			}
+
+			template<typename Y, typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+			intrusive_ptr(intrusive_ptr<Y> const& r) : px(r.px)
+			{
+				if (px != nullptr)
+				{
+					intrusive_ptr_add_ref(px);
+				}
+			}
+
+			// move constructor
+			intrusive_ptr(intrusive_ptr&& r) noexcept : px(r.px)
+			{
+				r.px = nullptr;
+			}
+
+			template<typename Y, typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+			intrusive_ptr(intrusive_ptr<Y>&& r) noexcept : px(r.px)
+			{
+				r.px = nullptr;
+			}
+
+			// destructor
+			~intrusive_ptr()
+			{
+				if (px != nullptr)
+				{
+					intrusive_ptr_release(px);
+				}
+			}
+
+			// Assignment operation
+			intrusive_ptr& operator=(intrusive_ptr const& r)
+			{
+				intrusive_ptr(r).swap(*this);
 				return *this;
 			}
 
 			template<typename Y>
-			weak_ptr& operator=(shared_ptr<Y> const& r) noexcept
+			intrusive_ptr& operator=(intrusive_ptr<Y> const& r)
 			{
-				weak_ptr(r).swap(*this);
+				intrusive_ptr(r).swap(*this);
 				return *this;
 			}
 
-			weak_ptr& operator=(weak_ptr&& r)  noexcept
+			intrusive_ptr& operator=(intrusive_ptr&& r) noexcept
 			{
-				weak_ptr(std::move(r)).swap(*this);
+				intrusive_ptr(std::move(r)).swap(*this);
 				return *this;
 			}
 
 			template<typename Y>
-			weak_ptr& operator=(weak_ptr<Y>&& r) noexcept
+			intrusive_ptr& operator=(intrusive_ptr<Y>&& r) noexcept
 			{
-				weak_ptr(std::move(r)).swap(*this);
+				intrusive_ptr(std::move(r)).swap(*this);
 				return *this;
 			}
 
-			// destrouctor
-			~weak_ptr() noexcept
+			intrusive_ptr& operator=(T* p)
 			{
-				if (pn != nullptr) 
-				{
-					pn->weak_release();
-				}
+				intrusive_ptr(p).swap(*this);
+				return *this;
 			}
 
 			// reset
 			void reset() noexcept
 			{
-				weak_ptr().swap(*this);
+				intrusive_ptr().swap(*this);
 			}
 
-			// swap
-			void swap(weak_ptr& other) noexcept
+			void reset(T* p, bool add_ref = true)
+			{
+				intrusive_ptr(p, add_ref).swap(*this);
+			}
+
+			// give up ownership without touching the count
+			T* detach() noexcept
+			{
+				T* p = px;
+				px = nullptr;
+				return p;
+			}
+
+			void swap(intrusive_ptr& other) noexcept
 			{
 				std::swap(px, other.px);
-				std::swap(pn, other.pn);
 			}
 
 			// observer
-			long use_count() const noexcept
+			T& operator*() const noexcept
 			{
-				return pn ? pn->use_count() : 0;
+				return *px;
 			}
 
-			bool expired() const noexcept 
+			T* operator->() const noexcept
 			{
-				return use_count() == 0;
+				return px;
 			}
 
-			shared_ptr<T> lock() const noexcept
+			T* get() const noexcept
 			{
-				if (expired()) 
-				{
-					return shared_ptr<T>();
-				}
+				return px;
+			}
 
-				shared_ptr<T> p;
-				p.px = px;
-				p.pn = pn;
-				if (pn)
-				{
-					pn->add_ref_lock();
-				}
-				return p;
+			explicit operator bool() const noexcept
+			{
+				return px != nullptr;
 			}
 		private:
-			typedef typename detail::sp_element<T>::type element_type;
-			element_type* px;
-			sp_counted_base* pn;
+			T* px;
 		};
 
+		// comparison operator
+		template<typename T, typename U>
+		inline bool operator==(intrusive_ptr<T> const& Lv, intrusive_ptr<U> const& Rv) noexcept
+		{
+			return Lv.get() == Rv.get();
+		}
+
+		template<typename T, typename U>
+		inline bool operator!=(intrusive_ptr<T> const& Lv, intrusive_ptr<U> const& Rv) noexcept
+		{
+			return Lv.get() != Rv.get();
+		}
+
+		template<typename T, typename U>
+		inline bool operator<(intrusive_ptr<T> const& Lv, intrusive_ptr<U> const& Rv) noexcept
+		{
+			return std::less<typename std::common_type<T*, U*>::type>()(Lv.get(), Rv.get());
+		}
+
+		template<typename T>
+		inline bool operator==(intrusive_ptr<T> const& Lv, std::nullptr_t) noexcept
+		{
+			return !Lv;
+		}
+
+		template<typename T>
+		inline bool operator!=(intrusive_ptr<T> const& Lv, std::nullptr_t) noexcept
+		{
+			return static_cast<bool>(Lv);
+		}
+
+		// A family of type conversion functions
+		template<typename T, typename U>
+		intrusive_ptr<T> static_pointer_cast(intrusive_ptr<U> const& r)
+		{
+			return intrusive_ptr<T>(static_cast<T*>(r.get()));
+		}
+
+		template<typename T, typename U>
+		intrusive_ptr<T> dynamic_pointer_cast(intrusive_ptr<U> const& r)
+		{
+			return intrusive_ptr<T>(dynamic_cast<T*>(r.get()));
+		}
+
+		template<typename T, typename U>
+		intrusive_ptr<T> const_pointer_cast(intrusive_ptr<U> const& r)
+		{
+			return intrusive_ptr<T>(const_cast<T*>(r.get()));
+		}
+
+		// moving casts hand the reference over instead of taking a new one
+		template<typename T, typename U>
+		intrusive_ptr<T> static_pointer_cast(intrusive_ptr<U>&& r) noexcept
+		{
+			return intrusive_ptr<T>(static_cast<T*>(r.detach()), false);
+		}
+
+		template<typename T, typename U>
+		intrusive_ptr<T> dynamic_pointer_cast(intrusive_ptr<U>&& r) noexcept
+		{
+			T* p = dynamic_cast<T*>(r.get());
+			if (p != nullptr)
+			{
+				r.detach();
+			}
+			return intrusive_ptr<T>(p, false);
+		}
+
+		template<typename T, typename U>
+		intrusive_ptr<T> const_pointer_cast(intrusive_ptr<U>&& r) noexcept
+		{
+			return intrusive_ptr<T>(const_cast<T*>(r.detach()), false);
+		}
 
+		//make_intrusive
+		template<typename T, typename... Args>
+		intrusive_ptr<T> make_intrusive(Args&&... args)
+		{
+			return intrusive_ptr<T>(new T(std::forward<Args>(args)...));
+		}
 
 		template <class T, class D=detail::default_delete<T>>
 		class unique_ptr;
@@ -693,7 +3388,10 @@ namespace utils
 		template <class T, class D /* = default_delete<T> */>
 		class unique_ptr : private detail::uniq_ptr_data <T, D>
 		{
-			
+			// unique_ptr<U, E> converts when U* does and its deleter can be moved into ours
+			template<typename U, typename E>
+			static constexpr bool accepts_v = !std::is_array_v<U> && std::is_convertible_v<U*, T*> &&
+				(std::is_reference_v<D> ? std::is_same_v<E, D> : std::is_convertible_v<E, D>);
 		public:
 			typedef T* pointer;
 			//typedef T element_type;
@@ -717,10 +3415,10 @@ namespace utils
 			}
 
 			// move constructor
-			unique_ptr(unique_ptr&& u) noexcept : data_type(std::move(u)) {}
+			unique_ptr(unique_ptr&& u) = default;
 
-			template<typename U, typename E>
-			unique_ptr(unique_ptr<U, E>&& u) noexcept : data_type(std::move(u)) {}
+			template<typename U, typename E, std::enable_if_t<accepts_v<U, E>, int> = 0>
+			unique_ptr(unique_ptr<U, E>&& u) noexcept : data_type(u.release(), std::forward<E>(u.get_deleter())) {}
 
 			// disabled copy
 			unique_ptr(const unique_ptr&) = delete;
@@ -729,14 +3427,10 @@ namespace utils
 			// destructor
 			~unique_ptr() = default;
 
-			// mov alignment operator
-			unique_ptr& operator=(unique_ptr&& u) noexcept {
-				data_type::reset(u.release());
-				data_type::get_deleter() = std::forward<D>(u.get_deleter());
-				return *this;
-			}
+			// move assignment operator, deleted along with the deleter's
+			unique_ptr& operator=(unique_ptr&& u) = default;
 
-			template<typename U, typename E>
+			template<typename U, typename E, std::enable_if_t<accepts_v<U, E> && std::is_assignable_v<D&, E&&>, int> = 0>
 			unique_ptr& operator=(unique_ptr<U, E>&& u) noexcept
 			{
 				data_type::reset(u.release());
@@ -785,7 +3479,7 @@ namespace utils
 
 			void swap(unique_ptr& u) noexcept 
 			{
-				data_type::swap(u.data_type);
+				data_type::swap(u);
 			}
 		private:
 			typedef detail::uniq_ptr_data<T, D> data_type;
@@ -812,7 +3506,7 @@ namespace utils
 			}
 
 			// move constructor
-			unique_ptr(unique_ptr&& u) noexcept : __data_type(std::move(u)) {}
+			unique_ptr(unique_ptr&& u) = default;
 
 			// disabled copy
 			unique_ptr(const unique_ptr&) = delete;
@@ -821,12 +3515,8 @@ namespace utils
 			// deconstructor
 			~unique_ptr() = default;
 
-			// move alignment operator
-			unique_ptr& operator=(unique_ptr && u) noexcept {
-				data_type::reset(u.release());
-				data_type::get_deleter() = std::forward<D>(u.get_deleter());
-				return *this;
-			}
+			// move assignment operator, deleted along with the deleter's
+			unique_ptr& operator=(unique_ptr&& u) = default;
 
 			// array access operator
 			T& operator[](size_t i) const
@@ -863,10 +3553,18 @@ namespace utils
 			{
 				data_type::reset(p);
 			}
+
+			void swap(unique_ptr& u) noexcept
+			{
+				data_type::swap(u);
+			}
 		private:
 			typedef detail::uniq_ptr_data<T, D> data_type;
 		};
 
+		static_assert(sizeof(unique_ptr<int>) == sizeof(int*), "unique_ptr with the default deleter must be one pointer wide");
+		static_assert(sizeof(unique_ptr<int[]>) == sizeof(int*), "unique_ptr with the default deleter must be one pointer wide");
+
 		// comparison operator
 		template<typename T, typename D>
 		inline bool operator==(const unique_ptr<T, D>& x, const unique_ptr<T, D>& y)
@@ -933,6 +3631,7 @@ namespace utils
 		template <class T, class... Args, std::enable_if_t<!std::is_array_v<T>, int> = 0>
 		inline unique_ptr<T> make_unique(Args&&... _Args)
 		{
+			sp_stats_unique_created<T>(sizeof(T));
 			return unique_ptr<T>(new T(std::forward<Args>(_Args)...));
 		}
 
@@ -940,9 +3639,98 @@ namespace utils
 		inline unique_ptr<T> make_unique(const size_t nSize)
 		{
 			using _Elem = std::remove_extent_t<T>;
+			sp_stats_unique_created<T>(nSize * sizeof(_Elem));
 			return unique_ptr<T>(new _Elem[nSize]());
 		}
 
+		//make_unique_for_overwrite: default-initialized, no zeroing of trivial types
+		template <class T, std::enable_if_t<!std::is_array_v<T>, int> = 0>
+		inline unique_ptr<T> make_unique_for_overwrite()
+		{
+			sp_stats_unique_created<T>(sizeof(T));
+			return unique_ptr<T>(new T);
+		}
+
+		template <class T, std::enable_if_t<std::is_array_v<T>&& std::extent_v<T> == 0, int> = 0>
+		inline unique_ptr<T> make_unique_for_overwrite(const size_t nSize)
+		{
+			using _Elem = std::remove_extent_t<T>;
+			sp_stats_unique_created<T>(nSize * sizeof(_Elem));
+			return unique_ptr<T>(new _Elem[nSize]);
+		}
+
+		//aligned arrays
+		constexpr std::size_t sp_huge_page_size = std::size_t(2) * 1024 * 1024;
+
+		enum class sp_page_hint
+		{
+			none,
+			// ask the kernel to back the buffer with transparent huge pages (Linux
+			// madvise(MADV_HUGEPAGE)); ignored elsewhere
+			huge_pages
+		};
+
+		// advise on whole pages inside [p, p + bytes); defined in smart_ptr.cpp
+		void sp_advise_huge_pages(void* p, std::size_t bytes) noexcept;
+
+		// deleter for make_unique_aligned: destroys the elements and frees with the alignment
+		template<typename T>
+		struct aligned_array_delete
+		{
+			std::size_t count;
+			std::size_t alignment;
+
+			void operator()(T* p) const noexcept
+			{
+				if constexpr (!std::is_trivially_destructible<T>::value)
+				{
+					for (std::size_t i = count; i != 0; --i)
+					{
+						p[i - 1].~T();
+					}
+				}
+				::operator delete(static_cast<void*>(p), std::align_val_t(alignment));
+			}
+		};
+
+		//make_unique_aligned<T[]>(n, alignment): n default-initialized elements starting on an
+		//alignment boundary (a power of two no less than alignof(T): sp_cache_line_size, a SIMD
+		//width, sp_huge_page_size; anything else throws std::invalid_argument)
+		template <class T, std::enable_if_t<std::is_array_v<T>&& std::extent_v<T> == 0, int> = 0>
+		unique_ptr<T, aligned_array_delete<std::remove_extent_t<T>>> make_unique_aligned(std::size_t nSize, std::size_t alignment, sp_page_hint hint = sp_page_hint::none)
+		{
+			using _Elem = std::remove_extent_t<T>;
+			if (alignment < alignof(_Elem) || (alignment & (alignment - 1)) != 0)
+			{
+				throw std::invalid_argument("make_unique_aligned: alignment must be a power of two no less than alignof(T)");
+			}
+			if (nSize > std::size_t(-1) / sizeof(_Elem))
+			{
+				throw std::bad_array_new_length();
+			}
+			std::size_t bytes = nSize * sizeof(_Elem);
+			_Elem* p = static_cast<_Elem*>(::operator new(bytes, std::align_val_t(alignment)));
+			if (hint == sp_page_hint::huge_pages)
+			{
+				sp_advise_huge_pages(p, bytes);
+			}
+			std::size_t i = 0;
+			try
+			{
+				for (; i < nSize; ++i)
+				{
+					::new (static_cast<void*>(p + i)) _Elem;
+				}
+			}
+			catch (...)
+			{
+				aligned_array_delete<_Elem>{ i, alignment }(p);
+				throw;
+			}
+			sp_stats_unique_created<T>(bytes);
+			return unique_ptr<T, aligned_array_delete<_Elem>>(p, aligned_array_delete<_Elem>{ nSize, alignment });
+		}
+
 		//template<typename T, typename... Args>
 		//inline unique_ptr<T> make_unique(Args&&... args) 
 		//{
@@ -954,6 +3742,254 @@ namespace utils
 		//{
 		//	return unique_ptr<T>(new typename std::remove_extent<T>::type[size]());
 		//}
+
+//-------------------value_ptr---------------------------------
+		// sp_value_ops: what value_ptr needs to know about the dynamic type it holds. The
+		// storage is the value_ptr's buffer: either the object itself or, for objects that
+		// did not fit, a pointer to the heap copy.
+		struct sp_value_ops
+		{
+			void* (*object)(void* storage) noexcept;
+			void (*relocate)(void* dst, void* src) noexcept;
+			void (*destroy)(void* storage) noexcept;
+		};
+
+		template<typename D>
+		struct sp_value_inline_ops
+		{
+			static void* object(void* storage) noexcept
+			{
+				return storage;
+			}
+
+			static void relocate(void* dst, void* src) noexcept
+			{
+				D* from = static_cast<D*>(src);
+				::new (dst) D(std::move(*from));
+				from->~D();
+			}
+
+			static void destroy(void* storage) noexcept
+			{
+				static_cast<D*>(storage)->~D();
+			}
+
+			static constexpr sp_value_ops table{ &object, &relocate, &destroy };
+		};
+
+		template<typename D>
+		struct sp_value_heap_ops
+		{
+			static void* object(void* storage) noexcept
+			{
+				return *static_cast<D**>(storage);
+			}
+
+			static void relocate(void* dst, void* src) noexcept
+			{
+				*static_cast<D**>(dst) = *static_cast<D**>(src);
+			}
+
+			static void destroy(void* storage) noexcept
+			{
+				delete *static_cast<D**>(storage);
+			}
+
+			static constexpr sp_value_ops table{ &object, &relocate, &destroy };
+		};
+
+		// value_ptr<T, InlineSize, Align>: owning pointer to a (usually polymorphic) T that
+		// builds the object in its own buffer when the dynamic type fits InlineSize and
+		// Align and is nothrow move constructible, and on the heap otherwise. Move-only;
+		// moving an inline object moves the object itself, so T* taken from get() does not
+		// survive a move of the value_ptr.
+		template<typename T, std::size_t InlineSize = 64, std::size_t Align = alignof(std::max_align_t)>
+		class value_ptr
+		{
+			template<typename U, std::size_t N, std::size_t A> friend class value_ptr;
+		public:
+			typedef T element_type;
+
+			template<typename D>
+			static constexpr bool fits_inline = sizeof(D) <= InlineSize && alignof(D) <= Align &&
+				std::is_nothrow_move_constructible<D>::value;
+
+			constexpr value_ptr() noexcept : m_ops(nullptr), m_ptr(nullptr) {}
+
+			constexpr value_ptr(std::nullptr_t) noexcept : m_ops(nullptr), m_ptr(nullptr) {}
+
+			value_ptr(value_ptr&& r) noexcept : m_ops(nullptr), m_ptr(nullptr)
+			{
+				take(r, r.m_ptr);
+			}
+
+			template<typename U, typename = std::enable_if_t<std::is_convertible<U*, T*>::value>>
+			value_ptr(value_ptr<U, InlineSize, Align>&& r) noexcept : m_ops(nullptr), m_ptr(nullptr)
+			{
+				take(r, r.m_ptr);
+			}
+
+			value_ptr(value_ptr const&) = delete;
+			value_ptr& operator=(value_ptr const&) = delete;
+
+			~value_ptr()
+			{
+				reset();
+			}
+
+			value_ptr& operator=(value_ptr&& r) noexcept
+			{
+				if (this != &r)
+				{
+					reset();
+					take(r, r.m_ptr);
+				}
+				return *this;
+			}
+
+			template<typename U, typename = std::enable_if_t<std::is_convertible<U*, T*>::value>>
+			value_ptr& operator=(value_ptr<U, InlineSize, Align>&& r) noexcept
+			{
+				reset();
+				take(r, r.m_ptr);
+				return *this;
+			}
+
+			// destroy the current object and build a D in its place
+			template<typename D, typename... Args>
+			D& emplace(Args&&... args)
+			{
+				static_assert(std::is_convertible<D*, T*>::value, "D must derive from T");
+				reset();
+				D* p;
+				if constexpr (fits_inline<D>)
+				{
+					p = ::new (static_cast<void*>(&m_storage)) D(std::forward<Args>(args)...);
+					m_ops = &sp_value_inline_ops<D>::table;
+				}
+				else
+				{
+					p = new D(std::forward<Args>(args)...);
+					*reinterpret_cast<D**>(&m_storage) = p;
+					m_ops = &sp_value_heap_ops<D>::table;
+				}
+				m_ptr = p;
+				return *p;
+			}
+
+			void reset() noexcept
+			{
+				if (m_ops != nullptr)
+				{
+					m_ops->destroy(&m_storage);
+					m_ops = nullptr;
+					m_ptr = nullptr;
+				}
+			}
+
+			void swap(value_ptr& other) noexcept
+			{
+				value_ptr tmp(std::move(other));
+				other = std::move(*this);
+				*this = std::move(tmp);
+			}
+
+			typename std::add_lvalue_reference<T>::type operator*() const noexcept
+			{
+				return *m_ptr;
+			}
+
+			T* operator->() const noexcept
+			{
+				return m_ptr;
+			}
+
+			T* get() const noexcept
+			{
+				return m_ptr;
+			}
+
+			// false when the object lives on the heap (or there is none)
+			bool is_inline() const noexcept
+			{
+				void* storage = const_cast<void*>(static_cast<void const*>(&m_storage));
+				return m_ops != nullptr && m_ops->object(storage) == storage;
+			}
+
+			explicit operator bool() const noexcept
+			{
+				return m_ptr != nullptr;
+			}
+		private:
+			template<typename Y, typename U, std::size_t N, std::size_t A>
+			friend value_ptr<Y, N, A> static_pointer_cast(value_ptr<U, N, A>&& r) noexcept;
+			template<typename Y, typename U, std::size_t N, std::size_t A>
+			friend value_ptr<Y, N, A> dynamic_pointer_cast(value_ptr<U, N, A>&& r) noexcept;
+			template<typename Y, typename U, std::size_t N, std::size_t A>
+			friend value_ptr<Y, N, A> const_pointer_cast(value_ptr<U, N, A>&& r) noexcept;
+
+			// Move r's object into this (empty) value_ptr; p is r's object seen as a T.
+			// The T subobject keeps its offset inside the complete object across the move.
+			template<typename U>
+			void take(value_ptr<U, InlineSize, Align>& r, T* p) noexcept
+			{
+				if (r.m_ops == nullptr)
+				{
+					return;
+				}
+				char* old_object = static_cast<char*>(r.m_ops->object(&r.m_storage));
+				std::ptrdiff_t offset = static_cast<char*>(const_cast<void*>(static_cast<void const volatile*>(p))) - old_object;
+				r.m_ops->relocate(&m_storage, &r.m_storage);
+				m_ops = r.m_ops;
+				m_ptr = reinterpret_cast<T*>(static_cast<char*>(m_ops->object(&m_storage)) + offset);
+				r.m_ops = nullptr;
+				r.m_ptr = nullptr;
+			}
+		private:
+			sp_value_ops const* m_ops;
+			T* m_ptr;
+			typename std::aligned_storage<InlineSize < sizeof(void*) ? sizeof(void*) : InlineSize, Align < alignof(void*) ? alignof(void*) : Align>::type m_storage;
+		};
+
+		template<typename T, std::size_t InlineSize = 64, std::size_t Align = alignof(std::max_align_t)>
+		using inline_unique_ptr = value_ptr<T, InlineSize, Align>;
+
+		// make_value_ptr<T, D>: a value_ptr<T> holding a D, built in place
+		template<typename T, typename D = T, std::size_t InlineSize = 64, std::size_t Align = alignof(std::max_align_t), typename... Args>
+		value_ptr<T, InlineSize, Align> make_value_ptr(Args&&... args)
+		{
+			value_ptr<T, InlineSize, Align> Ret;
+			Ret.template emplace<D>(std::forward<Args>(args)...);
+			return Ret;
+		}
+
+		// Casts move the object over; a failed dynamic_pointer_cast leaves r untouched
+		template<typename T, typename U, std::size_t N, std::size_t A>
+		value_ptr<T, N, A> static_pointer_cast(value_ptr<U, N, A>&& r) noexcept
+		{
+			value_ptr<T, N, A> Ret;
+			Ret.take(r, static_cast<T*>(r.get()));
+			return Ret;
+		}
+
+		template<typename T, typename U, std::size_t N, std::size_t A>
+		value_ptr<T, N, A> dynamic_pointer_cast(value_ptr<U, N, A>&& r) noexcept
+		{
+			value_ptr<T, N, A> Ret;
+			if (T* p = dynamic_cast<T*>(r.get()))
+			{
+				Ret.take(r, p);
+			}
+			return Ret;
+		}
+
+		template<typename T, typename U, std::size_t N, std::size_t A>
+		value_ptr<T, N, A> const_pointer_cast(value_ptr<U, N, A>&& r) noexcept
+		{
+			value_ptr<T, N, A> Ret;
+			Ret.take(r, const_cast<T*>(r.get()));
+			return Ret;
+		}
 	}//  namespace sp
 }//namespace utils
 
@@ -1,29 +1,177 @@
-#include "smart_ptr.h"
+#include "smart_prt.h"
 
-utils::sp::sp_counted_base::sp_counted_base()
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef SP_ENABLE_REGISTRY
+#include <chrono>
+#endif
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef SP_ENABLE_REGISTRY
+namespace
 {
-	m_use_count = 1;
-	m_weak_count = 1;
+	constexpr unsigned registry_shard_count = 16;
+
+	struct alignas(64) registry_shard
+	{
+		std::mutex lock;
+		utils::sp::sp_registry_node* head = nullptr;
+	};
+
+	registry_shard g_registry[registry_shard_count];
+	std::atomic<unsigned> g_next_registry_shard{ 0 };
+	thread_local unsigned t_registry_shard = g_next_registry_shard.fetch_add(1, std::memory_order_relaxed) % registry_shard_count;
+
+	std::int64_t registry_now() noexcept
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void registry_link(utils::sp::sp_registry_node& node, utils::sp::sp_counted_base const* block)
+	{
+		node.block = block;
+		node.type_name = "unknown";
+		node.bytes = 0;
+		node.created_ns = registry_now();
+		node.shard = t_registry_shard;
+		node.prev = nullptr;
+		registry_shard& shard = g_registry[node.shard];
+		std::lock_guard<std::mutex> guard(shard.lock);
+		node.next = shard.head;
+		if (shard.head != nullptr)
+		{
+			shard.head->prev = &node;
+		}
+		shard.head = &node;
+	}
+
+	void registry_unlink(utils::sp::sp_registry_node& node)
+	{
+		registry_shard& shard = g_registry[node.shard];
+		std::lock_guard<std::mutex> guard(shard.lock);
+		if (node.prev != nullptr)
+		{
+			node.prev->next = node.next;
+		}
+		else
+		{
+			shard.head = node.next;
+		}
+		if (node.next != nullptr)
+		{
+			node.next->prev = node.prev;
+		}
+	}
+}
+#endif
+
+utils::sp::sp_counted_base::sp_counted_base() : m_counts(use_one | weak_one)
+#ifdef SP_ENABLE_STATS
+	, m_stats(nullptr), m_stats_bytes(0)
+#endif
+{
+#ifdef SP_ENABLE_REGISTRY
+	registry_link(m_registry, this);
+#endif
+}
+
+#if defined(SP_ENABLE_STATS) || defined(SP_ENABLE_REGISTRY)
+utils::sp::sp_counted_base::~sp_counted_base()
+{
+#ifdef SP_ENABLE_STATS
+	if (m_stats != nullptr)
+	{
+		m_stats->remove_block(m_stats_bytes);
+		sp_stats_total().remove_block(m_stats_bytes);
+	}
+#endif
+#ifdef SP_ENABLE_REGISTRY
+	registry_unlink(m_registry);
+#endif
 }
+#endif
 
 void utils::sp::sp_counted_base::add_ref_copy()
 {
-	++m_use_count;
+#ifdef SP_ENABLE_STATS
+	stats_add(&sp_stats_record::increments);
+#endif
+	if (m_counts.load(std::memory_order_relaxed) & delegated_bit)
+	{
+		delegated_add_ref();
+		return;
+	}
+	// a new owner is always made from an existing one, nothing to order against
+	m_counts.fetch_add(use_one, std::memory_order_relaxed);
+}
+
+void utils::sp::sp_counted_base::add_ref_copy(long n)
+{
+#ifdef SP_ENABLE_STATS
+	stats_add(&sp_stats_record::increments);
+#endif
+	if (m_counts.load(std::memory_order_relaxed) & delegated_bit)
+	{
+		for (; n > 0; --n)
+		{
+			delegated_add_ref();
+		}
+		return;
+	}
+	m_counts.fetch_add(use_one * static_cast<std::uint64_t>(n), std::memory_order_relaxed);
 }
 
-void utils::sp::sp_counted_base::add_ref_lock()
+bool utils::sp::sp_counted_base::add_ref_lock_slow()
 {
-  ++m_use_count;
+	std::uint64_t cur = m_counts.load(std::memory_order_relaxed);
+	bool locked = false;
+	if (cur & delegated_bit)
+	{
+		locked = (cur & use_mask) != 0 && delegated_add_ref_lock();
+	}
+	else
+	{
+		// once the use count has reached zero the object is being disposed: never revive it
+		while ((cur & use_mask) != 0)
+		{
+			if (m_counts.compare_exchange_weak(cur, cur + use_one, std::memory_order_acq_rel, std::memory_order_relaxed))
+			{
+				locked = true;
+				break;
+			}
+		}
+	}
+#ifdef SP_ENABLE_STATS
+	stats_add(locked ? &sp_stats_record::locks_succeeded : &sp_stats_record::locks_failed);
+	if (locked)
+	{
+		stats_add(&sp_stats_record::increments);
+	}
+#endif
+	return locked;
 }
 
 void utils::sp::sp_counted_base::weak_add_ref()
 {
-	++m_weak_count;
+#ifdef SP_ENABLE_STATS
+	stats_add(&sp_stats_record::increments);
+#endif
+	m_counts.fetch_add(weak_one, std::memory_order_relaxed);
 }
 
 void utils::sp::sp_counted_base::weak_release()
 {
-	if (--m_weak_count == 0)
+#ifdef SP_ENABLE_STATS
+	stats_add(&sp_stats_record::decrements);
+#endif
+	if (m_counts.fetch_sub(weak_one, std::memory_order_acq_rel) >> 32 == 1)
 	{
 		destroy();
 	}
@@ -31,7 +179,54 @@ void utils::sp::sp_counted_base::weak_release()
 
 void utils::sp::sp_counted_base::release()
 {
-	if (--m_use_count == 0) 
+#ifdef SP_ENABLE_STATS
+	stats_add(&sp_stats_record::decrements);
+#endif
+	// Sole owner and no weak_ptr: nobody else can reach the block, so one acquire
+	// load (pairing with the release decrements of former owners) covers both
+	// dispose and destroy without any read-modify-write.
+	std::uint64_t cur = m_counts.load(std::memory_order_acquire);
+	if (cur == (use_one | weak_one))
+	{
+		dispose_destroy();
+		return;
+	}
+
+	if ((cur & delegated_bit) && !delegated_release())
+	{
+		return;
+	}
+	release_last();
+}
+
+void utils::sp::sp_counted_base::release(long n)
+{
+	if (m_counts.load(std::memory_order_relaxed) & delegated_bit)
+	{
+		for (; n > 0; --n)
+		{
+			release();
+		}
+		return;
+	}
+	if (n <= 0)
+	{
+		return;
+	}
+#ifdef SP_ENABLE_STATS
+	stats_add(&sp_stats_record::decrements);
+#endif
+	std::uint64_t delta = use_one * static_cast<std::uint64_t>(n);
+	if ((m_counts.fetch_sub(delta, std::memory_order_acq_rel) & use_mask) == delta)
+	{
+		dispose();
+		weak_release();
+	}
+}
+
+void utils::sp::sp_counted_base::release_last()
+{
+	if ((m_counts.fetch_sub(use_one, std::memory_order_acq_rel) & use_mask) == 1)
 	{
 		dispose();
 		weak_release();
@@ -40,5 +235,1468 @@ void utils::sp::sp_counted_base::release()
 
 long utils::sp::sp_counted_base::use_count() const
 {
-	return m_use_count.load();
+	std::uint64_t cur = m_counts.load(std::memory_order_relaxed);
+	if ((cur & delegated_bit) && (cur & use_mask) != 0)
+	{
+		return delegated_use_count();
+	}
+	return static_cast<long>(cur & use_mask);
+}
+
+void utils::sp::sp_counted_base::mark_delegated() noexcept
+{
+	m_counts.fetch_or(delegated_bit, std::memory_order_relaxed);
+}
+
+#ifdef SP_ENABLE_REGISTRY
+//-------------------control block registry---------------------------------
+void utils::sp::sp_counted_base::registry_describe(const char* type_name, std::size_t bytes) noexcept
+{
+	std::lock_guard<std::mutex> guard(g_registry[m_registry.shard].lock);
+	m_registry.type_name = type_name;
+	m_registry.bytes = bytes;
+}
+
+std::int64_t utils::sp::sp_registry_checkpoint() noexcept
+{
+	return registry_now();
+}
+
+std::vector<utils::sp::sp_registry_block> utils::sp::sp_registry_collect(std::int64_t since)
+{
+	std::vector<sp_registry_block> out;
+	std::int64_t now = registry_now();
+	for (registry_shard& shard : g_registry)
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		for (sp_registry_node const* node = shard.head; node != nullptr; node = node->next)
+		{
+			if (node->created_ns <= since)
+			{
+				continue;
+			}
+			// raw counts only: the block may be part way through destruction, waiting for
+			// this lock to unlink itself, so no virtual call is safe here
+			std::uint64_t cur = node->block->m_counts.load(std::memory_order_relaxed);
+			long use = static_cast<long>(cur & sp_counted_base::use_mask);
+			sp_registry_block b;
+			b.type_name = node->type_name;
+			b.bytes = node->bytes;
+			b.age_seconds = static_cast<double>(now - node->created_ns) / 1e9;
+			b.use_count = use;
+			b.weak_count = static_cast<long>(cur >> 32) - (use != 0 ? 1 : 0);
+			b.delegated = (cur & sp_counted_base::delegated_bit) != 0;
+			out.push_back(std::move(b));
+		}
+	}
+	return out;
+}
+
+std::string utils::sp::sp_registry_report(std::int64_t since)
+{
+	struct group
+	{
+		std::string type_name;
+		std::size_t count;
+		std::size_t delegated;
+		std::size_t bytes;
+		double oldest_seconds;
+	};
+
+	std::vector<sp_registry_block> blocks = sp_registry_collect(since);
+	std::sort(blocks.begin(), blocks.end(), [](sp_registry_block const& a, sp_registry_block const& b)
+		{
+			return a.type_name < b.type_name;
+		});
+	std::vector<group> groups;
+	for (sp_registry_block const& b : blocks)
+	{
+		if (groups.empty() || groups.back().type_name != b.type_name)
+		{
+			groups.push_back(group{ b.type_name, 0, 0, 0, 0.0 });
+		}
+		group& g = groups.back();
+		++g.count;
+		g.delegated += b.delegated ? 1 : 0;
+		g.bytes += b.bytes;
+		g.oldest_seconds = std::max(g.oldest_seconds, b.age_seconds);
+	}
+	std::sort(groups.begin(), groups.end(), [](group const& a, group const& b)
+		{
+			return a.bytes > b.bytes;
+		});
+
+	std::string out = std::to_string(blocks.size()) + " live control blocks\n";
+	for (group const& g : groups)
+	{
+		out += g.type_name;
+		out += ": " + std::to_string(g.count) + " blocks, ";
+		if (g.delegated != 0)
+		{
+			// their exact use counts are not readable from here
+			out += std::to_string(g.delegated) + " with delegated counts, ";
+		}
+		out += std::to_string(g.bytes) + " bytes, oldest ";
+		out += std::to_string(g.oldest_seconds) + " s\n";
+	}
+	return out;
+}
+#endif
+
+#ifdef SP_ENABLE_STATS
+//-------------------instrumentation---------------------------------
+namespace
+{
+	// records of every counted type, newest first; records are never unlinked
+	std::atomic<utils::sp::sp_stats_record*> g_stats_head{ nullptr };
+
+	void append_json_string(std::string& out, const char* s)
+	{
+		out += '"';
+		for (; *s != '\0'; ++s)
+		{
+			if (*s == '"' || *s == '\\')
+			{
+				out += '\\';
+			}
+			out += *s;
+		}
+		out += '"';
+	}
+}
+
+utils::sp::sp_stats_record::sp_stats_record(const char* type_name) noexcept : name(type_name)
+{
+	next = g_stats_head.load(std::memory_order_relaxed);
+	while (!g_stats_head.compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed))
+	{
+	}
+}
+
+void utils::sp::sp_stats_record::add_block(std::size_t bytes) noexcept
+{
+	blocks_created.fetch_add(1, std::memory_order_relaxed);
+	std::uint64_t live = bytes_live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	std::uint64_t peak = bytes_peak.load(std::memory_order_relaxed);
+	while (peak < live && !bytes_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+	{
+	}
+}
+
+void utils::sp::sp_stats_record::remove_block(std::size_t bytes) noexcept
+{
+	blocks_destroyed.fetch_add(1, std::memory_order_relaxed);
+	bytes_live.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+utils::sp::sp_stats_record& utils::sp::sp_stats_total() noexcept
+{
+	static sp_stats_record total("total");
+	return total;
+}
+
+void utils::sp::sp_counted_base::stats_bind(sp_stats_record& rec, std::size_t bytes) noexcept
+{
+	m_stats = &rec;
+	m_stats_bytes = bytes;
+	rec.add_block(bytes);
+	sp_stats_total().add_block(bytes);
+}
+
+void utils::sp::sp_counted_base::stats_add(std::atomic<std::uint64_t> sp_stats_record::* counter) noexcept
+{
+	if (m_stats != nullptr)
+	{
+		(m_stats->*counter).fetch_add(1, std::memory_order_relaxed);
+	}
+	(sp_stats_total().*counter).fetch_add(1, std::memory_order_relaxed);
+}
+
+std::vector<utils::sp::sp_stats_snapshot> utils::sp::sp_stats_collect()
+{
+	sp_stats_record& total = sp_stats_total();
+	std::vector<sp_stats_snapshot> out;
+	auto take = [&out](sp_stats_record const& rec)
+	{
+		sp_stats_snapshot s;
+		s.name = rec.name;
+		s.blocks_created = rec.blocks_created.load(std::memory_order_relaxed);
+		s.blocks_destroyed = rec.blocks_destroyed.load(std::memory_order_relaxed);
+		s.blocks_live = s.blocks_created - s.blocks_destroyed;
+		s.increments = rec.increments.load(std::memory_order_relaxed);
+		s.decrements = rec.decrements.load(std::memory_order_relaxed);
+		s.locks_succeeded = rec.locks_succeeded.load(std::memory_order_relaxed);
+		s.locks_failed = rec.locks_failed.load(std::memory_order_relaxed);
+		s.unique_created = rec.unique_created.load(std::memory_order_relaxed);
+		s.unique_bytes = rec.unique_bytes.load(std::memory_order_relaxed);
+		s.bytes_live = rec.bytes_live.load(std::memory_order_relaxed);
+		s.bytes_peak = rec.bytes_peak.load(std::memory_order_relaxed);
+		out.push_back(std::move(s));
+	};
+	take(total);
+	for (sp_stats_record* rec = g_stats_head.load(std::memory_order_acquire); rec != nullptr; rec = rec->next)
+	{
+		if (rec != &total)
+		{
+			take(*rec);
+		}
+	}
+	return out;
+}
+
+std::string utils::sp::sp_stats_dump_text()
+{
+	std::string out;
+	for (sp_stats_snapshot const& s : sp_stats_collect())
+	{
+		out += s.name;
+		out += ": blocks created " + std::to_string(s.blocks_created);
+		out += " destroyed " + std::to_string(s.blocks_destroyed);
+		out += " live " + std::to_string(s.blocks_live);
+		out += ", increments " + std::to_string(s.increments);
+		out += " decrements " + std::to_string(s.decrements);
+		out += ", lock ok " + std::to_string(s.locks_succeeded);
+		out += " failed " + std::to_string(s.locks_failed);
+		out += ", unique " + std::to_string(s.unique_created);
+		out += " (" + std::to_string(s.unique_bytes) + " bytes)";
+		out += ", bytes live " + std::to_string(s.bytes_live);
+		out += " peak " + std::to_string(s.bytes_peak);
+		out += '\n';
+	}
+	return out;
+}
+
+std::string utils::sp::sp_stats_dump_json()
+{
+	std::string out = "[";
+	bool first = true;
+	for (sp_stats_snapshot const& s : sp_stats_collect())
+	{
+		out += first ? "\n" : ",\n";
+		first = false;
+		out += "  {\"name\": ";
+		append_json_string(out, s.name.c_str());
+		out += ", \"blocks_created\": " + std::to_string(s.blocks_created);
+		out += ", \"blocks_destroyed\": " + std::to_string(s.blocks_destroyed);
+		out += ", \"blocks_live\": " + std::to_string(s.blocks_live);
+		out += ", \"increments\": " + std::to_string(s.increments);
+		out += ", \"decrements\": " + std::to_string(s.decrements);
+		out += ", \"locks_succeeded\": " + std::to_string(s.locks_succeeded);
+		out += ", \"locks_failed\": " + std::to_string(s.locks_failed);
+		out += ", \"unique_created\": " + std::to_string(s.unique_created);
+		out += ", \"unique_bytes\": " + std::to_string(s.unique_bytes);
+		out += ", \"bytes_live\": " + std::to_string(s.bytes_live);
+		out += ", \"bytes_peak\": " + std::to_string(s.bytes_peak);
+		out += "}";
+	}
+	out += "\n]\n";
+	return out;
+}
+#endif
+
+//-------------------local_sp_counted_base---------------------------------
+utils::sp::local_sp_counted_base::local_sp_counted_base()
+{
+	m_use_count = 1;
+	m_weak_count = 1;
+}
+
+void utils::sp::local_sp_counted_base::add_ref_copy()
+{
+	++m_use_count;
+}
+
+void utils::sp::local_sp_counted_base::add_ref_lock()
+{
+	++m_use_count;
+}
+
+void utils::sp::local_sp_counted_base::weak_add_ref()
+{
+	++m_weak_count;
+}
+
+void utils::sp::local_sp_counted_base::weak_release()
+{
+	if (--m_weak_count == 0)
+	{
+		destroy();
+	}
+}
+
+void utils::sp::local_sp_counted_base::release()
+{
+	if (--m_use_count == 0)
+	{
+		if (m_weak_count == 1)
+		{
+			dispose_destroy();
+			return;
+		}
+		dispose();
+		weak_release();
+	}
+}
+
+long utils::sp::local_sp_counted_base::use_count() const
+{
+	return m_use_count;
+}
+
+//-------------------sp_counted_pool---------------------------------
+namespace
+{
+	constexpr std::size_t pool_class_count = utils::sp::sp_counted_pool::max_size / utils::sp::sp_counted_pool::granularity;
+	constexpr std::size_t pool_batch = 32;          // blocks moved between a thread cache and the depot at once
+	constexpr std::size_t pool_slab_bytes = 16 * 1024;
+
+	struct pool_node
+	{
+		pool_node* next;
+	};
+
+	struct pool_depot
+	{
+		std::mutex lock;
+		pool_node* head = nullptr;
+	};
+
+	pool_depot& depot(std::size_t cls)
+	{
+		static pool_depot lists[pool_class_count];
+		return lists[cls];
+	}
+
+	std::size_t pool_class(std::size_t size)
+	{
+		return (size + utils::sp::sp_counted_pool::granularity - 1) / utils::sp::sp_counted_pool::granularity - 1;
+	}
+
+	// hand a chain of blocks to the depot
+	void depot_push(std::size_t cls, pool_node* first, pool_node* last)
+	{
+		pool_depot& d = depot(cls);
+		std::lock_guard<std::mutex> guard(d.lock);
+		last->next = d.head;
+		d.head = first;
+	}
+
+	// take up to pool_batch blocks from the depot, carving a new slab if it is empty
+	pool_node* depot_pop_batch(std::size_t cls, std::size_t& count)
+	{
+		{
+			pool_depot& d = depot(cls);
+			std::lock_guard<std::mutex> guard(d.lock);
+			if (d.head != nullptr)
+			{
+				pool_node* first = d.head;
+				pool_node* last = first;
+				count = 1;
+				while (count < pool_batch && last->next != nullptr)
+				{
+					last = last->next;
+					++count;
+				}
+				d.head = last->next;
+				last->next = nullptr;
+				return first;
+			}
+		}
+
+		std::size_t block = (cls + 1) * utils::sp::sp_counted_pool::granularity;
+		char* slab = static_cast<char*>(::operator new(pool_slab_bytes));
+		count = pool_slab_bytes / block;
+		for (std::size_t i = 0; i + 1 < count; ++i)
+		{
+			reinterpret_cast<pool_node*>(slab + i * block)->next = reinterpret_cast<pool_node*>(slab + (i + 1) * block);
+		}
+		reinterpret_cast<pool_node*>(slab + (count - 1) * block)->next = nullptr;
+		return reinterpret_cast<pool_node*>(slab);
+	}
+
+	struct pool_thread_cache
+	{
+		pool_node* head[pool_class_count] = {};
+		std::size_t count[pool_class_count] = {};
+
+		~pool_thread_cache();
+	};
+
+	thread_local pool_thread_cache t_pool_cache;
+	thread_local bool t_pool_cache_dead = false;  // trivially destructible, still valid after t_pool_cache is gone
+
+	pool_thread_cache::~pool_thread_cache()
+	{
+		t_pool_cache_dead = true;
+		for (std::size_t cls = 0; cls < pool_class_count; ++cls)
+		{
+			if (head[cls] != nullptr)
+			{
+				pool_node* last = head[cls];
+				while (last->next != nullptr)
+				{
+					last = last->next;
+				}
+				depot_push(cls, head[cls], last);
+			}
+		}
+	}
+}
+
+void* utils::sp::sp_counted_pool::allocate(std::size_t size)
+{
+	if (size > max_size)
+	{
+		return ::operator new(size);
+	}
+
+	std::size_t cls = pool_class(size);
+	if (t_pool_cache_dead)
+	{
+		std::size_t count = 0;
+		pool_node* first = depot_pop_batch(cls, count);
+		if (first->next != nullptr)
+		{
+			pool_node* last = first->next;
+			while (last->next != nullptr)
+			{
+				last = last->next;
+			}
+			depot_push(cls, first->next, last);
+		}
+		return first;
+	}
+
+	pool_thread_cache& cache = t_pool_cache;
+	if (cache.head[cls] == nullptr)
+	{
+		cache.head[cls] = depot_pop_batch(cls, cache.count[cls]);
+	}
+	pool_node* n = cache.head[cls];
+	cache.head[cls] = n->next;
+	--cache.count[cls];
+	return n;
+}
+
+void utils::sp::sp_counted_pool::deallocate(void* p, std::size_t size) noexcept
+{
+	if (size > max_size)
+	{
+		::operator delete(p);
+		return;
+	}
+
+	std::size_t cls = pool_class(size);
+	pool_node* n = static_cast<pool_node*>(p);
+	if (t_pool_cache_dead)
+	{
+		depot_push(cls, n, n);
+		return;
+	}
+
+	pool_thread_cache& cache = t_pool_cache;
+	n->next = cache.head[cls];
+	cache.head[cls] = n;
+	if (++cache.count[cls] > 2 * pool_batch)
+	{
+		// keep one batch locally, spill the rest so other threads can reuse it
+		pool_node* last = n;
+		for (std::size_t i = 1; i < pool_batch; ++i)
+		{
+			last = last->next;
+		}
+		pool_node* spill = last->next;
+		last->next = nullptr;
+		pool_node* spill_last = spill;
+		while (spill_last->next != nullptr)
+		{
+			spill_last = spill_last->next;
+		}
+		depot_push(cls, spill, spill_last);
+		cache.count[cls] = pool_batch;
+	}
+}
+
+
+//-------------------sp_node_heap---------------------------------
+namespace
+{
+	using utils::sp::sp_node_heap;
+
+	constexpr std::size_t node_class_count = sp_node_heap::max_size / utils::sp::sp_cache_line_size;
+	constexpr int mpol_preferred = 1;  // MPOL_PREFERRED from <numaif.h>, which libnuma-less systems lack
+
+	struct node_free
+	{
+		node_free* next;
+	};
+
+	struct node_arena
+	{
+		std::mutex lock;
+		node_free* head[node_class_count] = {};
+		char* bump = nullptr;
+		char* end = nullptr;
+	};
+
+	node_arena& arena(int node)
+	{
+		static node_arena arenas[sp_node_heap::max_nodes];
+		return arenas[node];
+	}
+
+	int clamp_node(int node)
+	{
+		return node < 0 || node >= sp_node_heap::max_nodes ? 0 : node;
+	}
+
+	std::size_t node_class(std::size_t size)
+	{
+		return (size + utils::sp::sp_cache_line_size - 1) / utils::sp::sp_cache_line_size - 1;
+	}
+
+	std::size_t node_round(std::size_t size)
+	{
+#if defined(__linux__)
+		std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+		return (size + page - 1) & ~(page - 1);
+#else
+		return size;
+#endif
+	}
+
+	// fresh pages preferring `node`; the policy applies when they are first touched
+	void* node_map(std::size_t bytes, int node)
+	{
+#if defined(__linux__) && defined(SYS_mbind)
+		void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+		{
+			throw std::bad_alloc();
+		}
+		constexpr std::size_t word_bits = 8 * sizeof(unsigned long);
+		unsigned long mask[sp_node_heap::max_nodes / word_bits + 1] = {};
+		mask[node / word_bits] |= 1ul << (node % word_bits);
+		// only a preference: without NUMA support the pages are ordinary memory
+		syscall(SYS_mbind, p, bytes, mpol_preferred, mask, static_cast<unsigned long>(sp_node_heap::max_nodes + 1), 0u);
+		return p;
+#else
+		(void)node;
+		return ::operator new(bytes, std::align_val_t(utils::sp::sp_cache_line_size));
+#endif
+	}
+
+	void node_unmap(void* p, std::size_t bytes) noexcept
+	{
+#if defined(__linux__) && defined(SYS_mbind)
+		munmap(p, bytes);
+#else
+		::operator delete(p, bytes, std::align_val_t(utils::sp::sp_cache_line_size));
+#endif
+	}
+}
+
+int utils::sp::sp_node_heap::current_node() noexcept
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned cpu = 0;
+	unsigned node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+	{
+		return clamp_node(static_cast<int>(node));
+	}
+#endif
+	return 0;
+}
+
+void* utils::sp::sp_node_heap::allocate(std::size_t size, int node)
+{
+	node = clamp_node(node);
+	if (size > max_size)
+	{
+		return node_map(node_round(size), node);
+	}
+
+	std::size_t cls = node_class(size);
+	std::size_t block = (cls + 1) * sp_cache_line_size;
+	node_arena& a = arena(node);
+	std::lock_guard<std::mutex> guard(a.lock);
+	if (a.head[cls] != nullptr)
+	{
+		node_free* n = a.head[cls];
+		a.head[cls] = n->next;
+		return n;
+	}
+	if (static_cast<std::size_t>(a.end - a.bump) < block)
+	{
+		// the tail of the old chunk is abandoned; chunks are never returned to the system
+		a.bump = static_cast<char*>(node_map(chunk_size, node));
+		a.end = a.bump + chunk_size;
+	}
+	void* p = a.bump;
+	a.bump += block;
+	return p;
+}
+
+void utils::sp::sp_node_heap::deallocate(void* p, std::size_t size, int node) noexcept
+{
+	node = clamp_node(node);
+	if (size > max_size)
+	{
+		node_unmap(p, node_round(size));
+		return;
+	}
+
+	std::size_t cls = node_class(size);
+	node_arena& a = arena(node);
+	std::lock_guard<std::mutex> guard(a.lock);
+	node_free* n = static_cast<node_free*>(p);
+	n->next = a.head[cls];
+	a.head[cls] = n;
+}
+
+//-------------------sp_epoch_domain---------------------------------
+namespace
+{
+	constexpr std::size_t epoch_collect_threshold = 64;
+
+	// one per thread that ever entered; records are reused after their thread exits
+	struct epoch_record
+	{
+		std::atomic<std::uint64_t> active{0};   // epoch entered, 0 while quiescent
+		std::atomic<bool> in_use{true};
+		epoch_record* next = nullptr;
+	};
+
+	struct epoch_retired
+	{
+		utils::sp::sp_counted_base* pn;
+		std::uint64_t epoch;
+	};
+
+	std::atomic<std::uint64_t> g_epoch{1};
+	std::atomic<epoch_record*> g_epoch_records{nullptr};
+
+	std::mutex& epoch_retired_lock()
+	{
+		static std::mutex lock;
+		return lock;
+	}
+
+	std::vector<epoch_retired>& epoch_retired_list()
+	{
+		static std::vector<epoch_retired> list;
+		return list;
+	}
+
+	epoch_record* epoch_claim_record()
+	{
+		for (epoch_record* r = g_epoch_records.load(std::memory_order_acquire); r != nullptr; r = r->next)
+		{
+			bool expected = false;
+			if (!r->in_use.load(std::memory_order_relaxed) && r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+			{
+				return r;
+			}
+		}
+
+		epoch_record* r = new epoch_record;
+		r->next = g_epoch_records.load(std::memory_order_relaxed);
+		while (!g_epoch_records.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed))
+		{
+		}
+		return r;
+	}
+
+	struct epoch_thread
+	{
+		epoch_record* record = nullptr;
+		unsigned nesting = 0;
+
+		~epoch_thread()
+		{
+			if (record != nullptr)
+			{
+				record->in_use.store(false, std::memory_order_release);
+			}
+		}
+	};
+
+	thread_local epoch_thread t_epoch;
+
+	// oldest epoch still announced by a reader, or UINT64_MAX if nobody is inside
+	std::uint64_t epoch_min_active()
+	{
+		std::uint64_t min_epoch = UINT64_MAX;
+		for (epoch_record* r = g_epoch_records.load(std::memory_order_acquire); r != nullptr; r = r->next)
+		{
+			std::uint64_t e = r->active.load(std::memory_order_seq_cst);
+			if (e != 0 && e < min_epoch)
+			{
+				min_epoch = e;
+			}
+		}
+		return min_epoch;
+	}
+}
+
+void utils::sp::sp_epoch_domain::enter() noexcept
+{
+	epoch_thread& t = t_epoch;
+	if (t.nesting++ == 0)
+	{
+		if (t.record == nullptr)
+		{
+			t.record = epoch_claim_record();
+		}
+		// seq_cst load and store: the epoch read is no newer than a retire it races with,
+		// and the announcement is ordered before any pointer this reader loads
+		t.record->active.store(g_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+	}
+}
+
+void utils::sp::sp_epoch_domain::leave() noexcept
+{
+	epoch_thread& t = t_epoch;
+	if (--t.nesting == 0)
+	{
+		t.record->active.store(0, std::memory_order_release);
+	}
+}
+
+void utils::sp::sp_epoch_domain::retire(sp_counted_base* pn)
+{
+	bool full = false;
+	{
+		std::lock_guard<std::mutex> guard(epoch_retired_lock());
+		epoch_retired_list().push_back({ pn, g_epoch.load(std::memory_order_seq_cst) });
+		full = epoch_retired_list().size() >= epoch_collect_threshold;
+	}
+	if (full)
+	{
+		collect();
+	}
+}
+
+void utils::sp::sp_epoch_domain::collect()
+{
+	std::vector<epoch_retired> ready;
+	{
+		std::lock_guard<std::mutex> guard(epoch_retired_lock());
+		std::uint64_t min_epoch = epoch_min_active();
+		std::vector<epoch_retired>& list = epoch_retired_list();
+		auto keep = std::partition(list.begin(), list.end(), [min_epoch](epoch_retired const& r) { return r.epoch >= min_epoch; });
+		ready.assign(keep, list.end());
+		list.erase(keep, list.end());
+		g_epoch.fetch_add(1, std::memory_order_seq_cst);
+	}
+
+	// release outside the lock, a disposed object may retire more blocks
+	for (epoch_retired& r : ready)
+	{
+		r.pn->release();
+	}
+}
+
+void utils::sp::sp_epoch_domain::synchronize()
+{
+	for (;;)
+	{
+		collect();
+		{
+			std::lock_guard<std::mutex> guard(epoch_retired_lock());
+			if (epoch_retired_list().empty())
+			{
+				return;
+			}
+		}
+		std::this_thread::yield();
+	}
+}
+
+//-------------------sp_deferred_reclaimer---------------------------------
+namespace
+{
+	// bounded multi-producer queue (Vyukov): each cell's sequence tells producers and
+	// the consumer whose turn it is, so neither side takes a lock
+	struct reclaim_cell
+	{
+		std::atomic<std::size_t> sequence;
+		utils::sp::sp_deferred_reclaimer::task_fn fn;
+		void* arg;
+	};
+
+	struct reclaimer_state
+	{
+		static constexpr std::size_t mask = utils::sp::sp_deferred_reclaimer::capacity - 1;
+		static_assert((utils::sp::sp_deferred_reclaimer::capacity & mask) == 0, "capacity must be a power of two");
+
+		reclaim_cell cells[utils::sp::sp_deferred_reclaimer::capacity];
+		alignas(64) std::atomic<std::size_t> enqueue_pos{0};
+		alignas(64) std::atomic<std::size_t> dequeue_pos{0};
+		alignas(64) std::atomic<std::uint64_t> posted{0};
+		std::atomic<std::uint64_t> completed{0};
+		std::atomic<bool> sleeping{false};
+		std::atomic<bool> stopping{false};
+		std::atomic<bool> stopped{false};  // worker joined: producers run what they queue
+
+		std::mutex lock;
+		std::condition_variable wake;
+		std::once_flag started;
+		std::thread worker;
+
+		reclaimer_state()
+		{
+			for (std::size_t i = 0; i < utils::sp::sp_deferred_reclaimer::capacity; ++i)
+			{
+				cells[i].sequence.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		~reclaimer_state()
+		{
+			if (worker.joinable())
+			{
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					stopping.store(true, std::memory_order_seq_cst);
+				}
+				wake.notify_one();
+				worker.join();
+			}
+			std::lock_guard<std::mutex> guard(lock);
+			stopped.store(true, std::memory_order_relaxed);
+			// pairs with the fence in post: either this pop sees a late push or that
+			// producer sees stopped
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			run_queued();
+		}
+
+		bool push(utils::sp::sp_deferred_reclaimer::task_fn fn, void* arg)
+		{
+			std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				reclaim_cell& cell = cells[pos & mask];
+				std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+				std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+				if (diff == 0)
+				{
+					if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						cell.fn = fn;
+						cell.arg = arg;
+						cell.sequence.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+				{
+					return false;
+				}
+				else
+				{
+					pos = enqueue_pos.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// single consumer
+		bool pop(utils::sp::sp_deferred_reclaimer::task_fn& fn, void*& arg)
+		{
+			std::size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+			reclaim_cell& cell = cells[pos & mask];
+			if (cell.sequence.load(std::memory_order_acquire) != pos + 1)
+			{
+				return false;
+			}
+			fn = cell.fn;
+			arg = cell.arg;
+			dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+			cell.sequence.store(pos + utils::sp::sp_deferred_reclaimer::capacity, std::memory_order_release);
+			return true;
+		}
+
+		// once the worker is gone, and only under lock
+		void run_queued()
+		{
+			utils::sp::sp_deferred_reclaimer::task_fn fn;
+			void* arg;
+			while (pop(fn, arg))
+			{
+				fn(arg);
+				completed.fetch_add(1, std::memory_order_release);
+			}
+		}
+
+		void run()
+		{
+			utils::sp::sp_deferred_reclaimer::task_fn fn;
+			void* arg;
+			for (;;)
+			{
+				while (pop(fn, arg))
+				{
+					fn(arg);
+					completed.fetch_add(1, std::memory_order_release);
+				}
+
+				std::unique_lock<std::mutex> guard(lock);
+				sleeping.store(true, std::memory_order_relaxed);
+				// pairs with the fence in notify: either this re-check sees the producer's
+				// push or the producer sees sleeping == true
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (pop(fn, arg))
+				{
+					sleeping.store(false, std::memory_order_relaxed);
+					guard.unlock();
+					fn(arg);
+					completed.fetch_add(1, std::memory_order_release);
+					continue;
+				}
+				if (stopping.load(std::memory_order_relaxed))
+				{
+					return;
+				}
+				wake.wait(guard);
+				sleeping.store(false, std::memory_order_relaxed);
+			}
+		}
+
+		void notify()
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (sleeping.load(std::memory_order_relaxed))
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				wake.notify_one();
+			}
+		}
+	};
+
+	reclaimer_state& reclaimer()
+	{
+		static reclaimer_state state;
+		return state;
+	}
+}
+
+void utils::sp::sp_deferred_reclaimer::post(task_fn fn, void* arg)
+{
+	reclaimer_state& state = reclaimer();
+	if (state.stopping.load(std::memory_order_relaxed))
+	{
+		fn(arg);
+		return;
+	}
+	std::call_once(state.started, [&state] { state.worker = std::thread([&state] { state.run(); }); });
+
+	// counted before it is visible, so its completion never satisfies a drain()
+	// that did not count it
+	state.posted.fetch_add(1, std::memory_order_relaxed);
+	if (!state.push(fn, arg))
+	{
+		// queue full: the releasing thread pays for its own teardown
+		state.posted.fetch_sub(1, std::memory_order_relaxed);
+		fn(arg);
+		return;
+	}
+	state.notify();
+	// notify's fence also orders this load after the push
+	if (state.stopped.load(std::memory_order_relaxed))
+	{
+		// the worker exited after the stopping check above: nobody else will run it
+		std::lock_guard<std::mutex> guard(state.lock);
+		state.run_queued();
+	}
+}
+
+void utils::sp::sp_deferred_reclaimer::drain()
+{
+	reclaimer_state& state = reclaimer();
+	std::uint64_t target = state.posted.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		// a post that found the queue full withdraws its count again
+		std::uint64_t now = state.posted.load(std::memory_order_relaxed);
+		if (state.completed.load(std::memory_order_acquire) >= (now < target ? now : target))
+		{
+			return;
+		}
+		state.notify();
+		std::this_thread::yield();
+	}
+}
+
+//-------------------sp_counted_biased---------------------------------
+namespace
+{
+	// the calling thread's owner_state, or null if it never created a biased block;
+	// a plain pointer so ownership checks don't register anything
+	thread_local void* t_biased_owner = nullptr;
+	// set once the thread's owner_state has retired; trivially destructible, so still
+	// valid while later thread_local destructors run
+	thread_local bool t_biased_retired = false;
+}
+
+struct utils::sp::sp_counted_biased::owner_state
+{
+	std::atomic<sp_counted_biased*> requests{nullptr};  // pushed by other threads
+	sp_counted_biased* unmerged = nullptr;              // blocks this thread still counts locally
+	std::atomic<long> refs{1};                          // the thread, plus one per live block
+
+	// pushed in place of requests once the owner has retired
+	static sp_counted_biased* closed()
+	{
+		return reinterpret_cast<sp_counted_biased*>(std::uintptr_t(1));
+	}
+
+	void unref()
+	{
+		if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			delete this;
+		}
+	}
+
+	void serve(sp_counted_biased* b)
+	{
+		while (b != nullptr)
+		{
+			sp_counted_biased* next = b->m_request_next;
+			if (!b->m_merged && b->merge())
+			{
+				b->release_last();
+			}
+			// drop the weak reference the requester took
+			b->weak_release();
+			b = next;
+		}
+	}
+
+	void serve_requests()
+	{
+		serve(requests.exchange(nullptr, std::memory_order_acquire));
+	}
+
+	// thread exit: hand every block over to the shared count, then close the request
+	// stack; requests that arrive later find their block already merged
+	void retire()
+	{
+		serve_requests();
+		while (unmerged != nullptr)
+		{
+			sp_counted_biased* b = unmerged;
+			if (b->merge())
+			{
+				b->release_last();
+			}
+		}
+		serve(requests.exchange(closed(), std::memory_order_acq_rel));
+		unref();
+	}
+};
+
+utils::sp::sp_counted_biased::owner_state* utils::sp::sp_counted_biased::current_owner()
+{
+	struct holder
+	{
+		owner_state* state = new owner_state;
+		~holder()
+		{
+			t_biased_owner = nullptr;
+			t_biased_retired = true;
+			state->retire();
+		}
+	};
+	if (t_biased_retired)
+	{
+		return nullptr;
+	}
+	thread_local holder h;
+	t_biased_owner = h.state;
+	return h.state;
+}
+
+// Blocks created after the thread retired start out merged: every count is shared.
+utils::sp::sp_counted_biased::sp_counted_biased()
+	: m_owner(current_owner()), m_local(1), m_shared(2), m_merge_requested(false), m_merged(false),
+	m_request_next(nullptr), m_prev(nullptr), m_next(nullptr)
+{
+	mark_delegated();
+	if (m_owner == nullptr)
+	{
+		m_local.store(0, std::memory_order_relaxed);
+		m_shared.store(3, std::memory_order_relaxed);
+		m_merged = true;
+		return;
+	}
+	m_owner->refs.fetch_add(1, std::memory_order_relaxed);
+	m_next = m_owner->unmerged;
+	if (m_next != nullptr)
+	{
+		m_next->m_prev = this;
+	}
+	m_owner->unmerged = this;
+}
+
+utils::sp::sp_counted_biased::~sp_counted_biased()
+{
+	if (m_owner != nullptr)
+	{
+		m_owner->unref();
+	}
+}
+
+void utils::sp::sp_counted_biased::flush()
+{
+	if (owner_state* owner = current_owner())
+	{
+		owner->serve_requests();
+	}
+}
+
+bool utils::sp::sp_counted_biased::is_owner_local() const
+{
+	return m_owner == t_biased_owner && !m_merged;
+}
+
+// owner thread: fold the local count into the shared one; true if nothing is left
+bool utils::sp::sp_counted_biased::merge()
+{
+	m_merged = true;
+	if (m_prev != nullptr)
+	{
+		m_prev->m_next = m_next;
+	}
+	else
+	{
+		m_owner->unmerged = m_next;
+	}
+	if (m_next != nullptr)
+	{
+		m_next->m_prev = m_prev;
+	}
+
+	// m_local keeps its value: a racing lock that still sees the unmerged word reads
+	// the count it had
+	long local = m_local.load(std::memory_order_relaxed);
+	// add the local references, drop the unit that stood for them, set the merged bit
+	std::int64_t delta = 2 * (static_cast<std::int64_t>(local) - 1) + 1;
+	return m_shared.fetch_add(delta, std::memory_order_acq_rel) + delta == 1;
+}
+
+// the caller holds a weak reference, handed to the owner with the request
+void utils::sp::sp_counted_biased::request_merge()
+{
+	m_request_next = m_owner->requests.load(std::memory_order_relaxed);
+	do
+	{
+		if (m_request_next == owner_state::closed())
+		{
+			// the owner retired and merged this block on the way out
+			weak_release();
+			return;
+		}
+	} while (!m_owner->requests.compare_exchange_weak(m_request_next, this, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void utils::sp::sp_counted_biased::delegated_add_ref()
+{
+	if (is_owner_local())
+	{
+		m_local.store(m_local.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+	m_shared.fetch_add(2, std::memory_order_relaxed);
+}
+
+bool utils::sp::sp_counted_biased::delegated_release()
+{
+	if (is_owner_local())
+	{
+		if (m_owner->requests.load(std::memory_order_relaxed) != nullptr)
+		{
+			// may merge this block too; our own reference keeps it alive
+			m_owner->serve_requests();
+		}
+		if (!m_merged)
+		{
+			long local = m_local.load(std::memory_order_relaxed) - 1;
+			m_local.store(local, std::memory_order_relaxed);
+			return local == 0 && merge();
+		}
+	}
+
+	// A decrement that exhausts the unmerged shared side needs a merge request, and the
+	// owner may merge and free the block as soon as it lands: pin the block first.
+	bool pinned = false;
+	std::int64_t w = m_shared.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		bool exhausts = (w & 1) == 0 && w - 2 <= 0;
+		if (exhausts && !pinned)
+		{
+			weak_add_ref();
+			pinned = true;
+		}
+		if (m_shared.compare_exchange_weak(w, w - 2, std::memory_order_acq_rel, std::memory_order_relaxed))
+		{
+			w -= 2;
+			break;
+		}
+	}
+	bool requesting = (w & 1) == 0 && w <= 0 && !m_merge_requested.exchange(true, std::memory_order_acq_rel);
+	if (requesting)
+	{
+		request_merge();
+	}
+	else if (pinned)
+	{
+		weak_release();
+	}
+	return w == 1;
+}
+
+bool utils::sp::sp_counted_biased::delegated_add_ref_lock()
+{
+	if (is_owner_local() && m_owner->requests.load(std::memory_order_relaxed) != nullptr)
+	{
+		// may merge this block; the caller's weak reference keeps it alive
+		m_owner->serve_requests();
+	}
+
+	// Every successful lock, the owner's too, takes a shared reference, so liveness is
+	// decided and recorded in one CAS. An unmerged block with shared references left is
+	// alive: the owner merges as soon as its local count reaches zero. Once the shared
+	// side is drained the count is m_local + shared - 1, and a block at zero stays there
+	// until the owner merges it: nothing but the owner changes m_local, and only while
+	// it holds a reference.
+	std::int64_t w = m_shared.load(std::memory_order_acquire);
+	for (;;)
+	{
+		if (w == 1)
+		{
+			return false;
+		}
+		if ((w & 1) == 0 && w <= 0 && m_local.load(std::memory_order_relaxed) + w / 2 - 1 <= 0)
+		{
+			std::int64_t seen = m_shared.load(std::memory_order_acquire);
+			if (seen == w)
+			{
+				return false;
+			}
+			w = seen;
+			continue;
+		}
+		if (m_shared.compare_exchange_weak(w, w + 2, std::memory_order_acq_rel, std::memory_order_acquire))
+		{
+			return true;
+		}
+	}
+}
+
+long utils::sp::sp_counted_biased::delegated_use_count() const
+{
+	std::int64_t w = m_shared.load(std::memory_order_relaxed);
+	std::int64_t shared = (w - (w & 1)) / 2;
+	if (w & 1)
+	{
+		return static_cast<long>(shared);
+	}
+	return static_cast<long>(m_local.load(std::memory_order_relaxed) + shared - 1);
+}
+
+//-------------------sp_counted_sharded---------------------------------
+namespace
+{
+	std::atomic<unsigned> g_next_shard{0};
+	thread_local unsigned t_shard = g_next_shard.fetch_add(1, std::memory_order_relaxed) % utils::sp::sp_counted_sharded::shard_count;
+
+	std::int32_t shard_count_of(std::uint64_t word)
+	{
+		return static_cast<std::int32_t>(static_cast<std::uint32_t>(word));
+	}
+
+	std::uint64_t shard_word(std::uint64_t old_word, std::int64_t count)
+	{
+		return (((old_word >> 32) + 1) << 32) | static_cast<std::uint32_t>(static_cast<std::int32_t>(count));
+	}
+
+	// one more reference and one more version; per-thread slots never go negative, so the
+	// count half never carries into the version
+	constexpr std::uint64_t shard_copy = (std::uint64_t(1) << 32) + 1;
+
+	// add delta to a versioned slot, returning the new count
+	std::int64_t shard_add(std::atomic<std::uint64_t>& slot, std::int64_t delta)
+	{
+		std::uint64_t w = slot.load(std::memory_order_relaxed);
+		while (!slot.compare_exchange_weak(w, shard_word(w, shard_count_of(w) + delta), std::memory_order_acq_rel, std::memory_order_relaxed))
+		{
+		}
+		return shard_count_of(w) + delta;
+	}
+}
+
+utils::sp::sp_counted_sharded::sp_counted_sharded() : m_reconciling(false), m_dead(false)
+{
+	mark_delegated();
+	m_central.word.store(1, std::memory_order_relaxed);
+	for (shard& s : m_shards)
+	{
+		s.word.store(0, std::memory_order_relaxed);
+	}
+}
+
+// relaxed like sp_counted_base::add_ref_copy: the copier already holds a reference
+void utils::sp::sp_counted_sharded::delegated_add_ref()
+{
+	m_shards[t_shard].word.fetch_add(shard_copy, std::memory_order_relaxed);
+}
+
+bool utils::sp::sp_counted_sharded::delegated_release()
+{
+	std::atomic<std::uint64_t>& slot = m_shards[t_shard].word;
+	std::uint64_t w = slot.load(std::memory_order_relaxed);
+	while (shard_count_of(w) > 0)
+	{
+		if (slot.compare_exchange_weak(w, shard_word(w, shard_count_of(w) - 1), std::memory_order_acq_rel, std::memory_order_relaxed))
+		{
+			// slots never go negative, so a central count above zero proves someone is left;
+			// a stale central count is caught by reconcile, which reads this slot's latest value
+			if (shard_count_of(w) > 1 || shard_count_of(m_central.word.load(std::memory_order_acquire)) > 0)
+			{
+				return false;
+			}
+			return reconcile();
+		}
+	}
+
+	// this slot has nothing to give back: the reference was counted elsewhere
+	if (shard_add(m_central.word, -1) > 0)
+	{
+		return false;
+	}
+	return reconcile();
+}
+
+bool utils::sp::sp_counted_sharded::delegated_add_ref_lock()
+{
+	lock_reconcile();
+	bool alive = !m_dead;
+	if (alive)
+	{
+		shard_add(m_central.word, 1);
+	}
+	unlock_reconcile();
+	return alive;
+}
+
+long utils::sp::sp_counted_sharded::delegated_use_count() const
+{
+	std::int64_t sum = shard_count_of(m_central.word.load(std::memory_order_relaxed));
+	for (shard const& s : m_shards)
+	{
+		sum += shard_count_of(s.word.load(std::memory_order_relaxed));
+	}
+	return static_cast<long>(sum);
+}
+
+void utils::sp::sp_counted_sharded::lock_reconcile()
+{
+	while (m_reconciling.exchange(true, std::memory_order_acquire))
+	{
+		std::this_thread::yield();
+	}
+}
+
+void utils::sp::sp_counted_sharded::unlock_reconcile()
+{
+	m_reconciling.store(false, std::memory_order_release);
+}
+
+// true if the total is zero; the caller then runs the final release
+bool utils::sp::sp_counted_sharded::reconcile()
+{
+	lock_reconcile();
+	if (m_dead)
+	{
+		unlock_reconcile();
+		return false;
+	}
+
+	// Collect with read-modify-writes: they see the latest value of every slot, so a
+	// release that emptied its slot and then read a stale central count is never missed
+	// here, and the releases themselves need no more than acquire/release.
+	std::uint64_t first[shard_count + 1];
+	std::uint64_t second[shard_count + 1];
+	for (;;)
+	{
+		first[0] = m_central.word.fetch_add(0, std::memory_order_acq_rel);
+		for (std::size_t i = 0; i < shard_count; ++i)
+		{
+			first[i + 1] = m_shards[i].word.fetch_add(0, std::memory_order_acq_rel);
+		}
+		second[0] = m_central.word.fetch_add(0, std::memory_order_acq_rel);
+		for (std::size_t i = 0; i < shard_count; ++i)
+		{
+			second[i + 1] = m_shards[i].word.fetch_add(0, std::memory_order_acq_rel);
+		}
+		// every version unchanged: the first collect is a consistent snapshot
+		if (std::equal(first, first + shard_count + 1, second))
+		{
+			break;
+		}
+	}
+
+	std::int64_t sum = 0;
+	for (std::uint64_t w : first)
+	{
+		sum += shard_count_of(w);
+	}
+	if (sum == 0)
+	{
+		// nobody holds a reference and weak_ptr::lock waits for this lock, so it stays zero
+		m_dead = true;
+	}
+	else if (shard_count_of(first[0]) <= 0)
+	{
+		rebalance();
+	}
+	unlock_reconcile();
+	return sum == 0;
+}
+
+// move the per-thread counts into the central slot so releases stop reconciling
+void utils::sp::sp_counted_sharded::rebalance()
+{
+	for (shard& s : m_shards)
+	{
+		std::uint64_t w = s.word.load(std::memory_order_relaxed);
+		while (shard_count_of(w) > 0 && !s.word.compare_exchange_weak(w, shard_word(w, 0), std::memory_order_acq_rel, std::memory_order_relaxed))
+		{
+		}
+		if (shard_count_of(w) > 0)
+		{
+			shard_add(m_central.word, shard_count_of(w));
+		}
+	}
+}
+
+//-------------------aligned arrays---------------------------------
+void utils::sp::sp_advise_huge_pages(void* p, std::size_t bytes) noexcept
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	std::uintptr_t page = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+	std::uintptr_t begin = (reinterpret_cast<std::uintptr_t>(p) + page - 1) & ~(page - 1);
+	std::uintptr_t end = reinterpret_cast<std::uintptr_t>(p) + bytes;
+	if (begin < end)
+	{
+		// only a hint: failure (THP disabled, not anonymous memory) changes nothing
+		madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+	}
+#else
+	(void)p;
+	(void)bytes;
+#endif
 }
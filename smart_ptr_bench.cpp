@@ -0,0 +1,1224 @@
+// Microbenchmarks: utils::sp against std:: smart pointers.
+// Each case runs on 1, 2, 4 .. N threads and reports ns/op and allocations/op.
+// Build with optimisations, e.g.
+//   cmake -S . -B build && cmake --build build
+// or
+//   g++ -std=c++17 -O2 -pthread smart_ptr_bench.cpp smart_ptr.cpp -o smart_ptr_bench
+// Usage: smart_ptr_bench [iterations per thread] [max threads]
+// "adopt new" takes its control blocks from wherever shared_ptr(Y*) does: the
+// heap, or sp_counted_pool when SP_USE_COUNTED_POOL is defined. "adopt new (pool)"
+// always takes them from sp_counted_pool through an allocator, so one run shows
+// the adoption rate before and after the pool; "pool block" times the pool alone.
+#include "smart_prt.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+//-------------------allocation counting---------------------------------
+namespace
+{
+	thread_local std::size_t t_allocs = 0;
+
+	// Every replacement below goes through this pair. Keeping free out of line stops
+	// the compiler from pairing it with the new-expressions it sees inlined
+	// (-Wmismatched-new-delete); operator new and operator delete still match.
+	void* counted_allocate(std::size_t size, std::size_t align)
+	{
+		++t_allocs;
+		size = size ? size : 1;
+		void* p = align <= alignof(std::max_align_t) ? std::malloc(size) : std::aligned_alloc(align, (size + align - 1) / align * align);
+		if (p == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+
+#if defined(__GNUC__)
+	__attribute__((noinline))
+#endif
+	void counted_deallocate(void* p) noexcept
+	{
+		std::free(p);
+	}
+}
+
+void* operator new(std::size_t size)
+{
+	return counted_allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, std::align_val_t al)
+{
+	return counted_allocate(size, static_cast<std::size_t>(al));
+}
+
+void operator delete(void* p) noexcept
+{
+	counted_deallocate(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	counted_deallocate(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+	counted_deallocate(p);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept
+{
+	counted_deallocate(p);
+}
+
+namespace
+{
+	//-------------------library adapters---------------------------------
+	struct base_object
+	{
+		virtual ~base_object() = default;
+		long value = 1;
+	};
+
+	struct derived_object : base_object
+	{
+		long extra = 2;
+	};
+
+	struct sp_lib
+	{
+		template<typename T> using shared = utils::sp::shared_ptr<T>;
+		template<typename T> using weak = utils::sp::weak_ptr<T>;
+		template<typename T> using unique = utils::sp::unique_ptr<T>;
+		template<typename T> using atomic_shared = utils::sp::atomic_shared_ptr<T>;
+
+		template<typename T, typename... Args>
+		static shared<T> make_shared(Args&&... args)
+		{
+			return utils::sp::make_shared<T>(std::forward<Args>(args)...);
+		}
+
+		template<typename T, typename... Args>
+		static unique<T> make_unique(Args&&... args)
+		{
+			return utils::sp::make_unique<T>(std::forward<Args>(args)...);
+		}
+
+		template<typename T, typename... Args>
+		static shared<T> make_shared_separate(Args&&... args)
+		{
+			return utils::sp::make_shared_separate<T>(std::forward<Args>(args)...);
+		}
+
+		template<typename T, typename... Args>
+		static shared<T> make_shared_deferred(Args&&... args)
+		{
+			return utils::sp::make_shared_deferred<T>(std::forward<Args>(args)...);
+		}
+
+		template<typename T, typename... Args>
+		static shared<T> make_shared_biased(Args&&... args)
+		{
+			return utils::sp::make_shared_biased<T>(std::forward<Args>(args)...);
+		}
+
+		static void* block_allocate(std::size_t size)
+		{
+			return utils::sp::sp_counted_pool::allocate(size);
+		}
+
+		static void block_deallocate(void* p, std::size_t size) noexcept
+		{
+			utils::sp::sp_counted_pool::deallocate(p, size);
+		}
+
+		template<typename T, typename... Args>
+		static shared<T> make_shared_sharded(Args&&... args)
+		{
+			return utils::sp::make_shared_sharded<T>(std::forward<Args>(args)...);
+		}
+
+		// finish teardown handed to the reclaimer thread or the epoch domain
+		static void drain()
+		{
+			utils::sp::sp_deferred_reclaimer::drain();
+			utils::sp::sp_epoch_domain::synchronize();
+		}
+
+		// read-mostly object read through an epoch guard, without touching the counts
+		template<typename T>
+		struct read_mostly
+		{
+			explicit read_mostly(shared<T> p) : value(std::move(p)) {}
+
+			template<typename F>
+			void read(F const& f) const
+			{
+				utils::sp::sp_epoch_guard guard;
+				f(*value.get(guard));
+			}
+
+			utils::sp::guarded_shared_ptr<T> value;
+		};
+
+		template<typename T, typename U>
+		static shared<T> static_cast_(shared<U> const& r)
+		{
+			return utils::sp::static_pointer_cast<T>(r);
+		}
+
+		template<typename T, typename U>
+		static shared<T> dynamic_cast_(shared<U> const& r)
+		{
+			return utils::sp::dynamic_pointer_cast<T>(r);
+		}
+
+		template<typename T>
+		static void fan_out(shared<T> const& p, std::size_t n, std::vector<shared<T>>& out)
+		{
+			utils::sp::share_n(p, n, std::back_inserter(out));
+		}
+
+		template<typename T>
+		static void drop_all(std::vector<shared<T>>& v)
+		{
+			utils::sp::release_all(v.begin(), v.end());
+			v.clear();
+		}
+	};
+
+	struct std_lib
+	{
+		template<typename T> using shared = std::shared_ptr<T>;
+		template<typename T> using weak = std::weak_ptr<T>;
+		template<typename T> using unique = std::unique_ptr<T>;
+
+		// C++17 has no std::atomic<std::shared_ptr>: the atomic_load free function
+		template<typename T>
+		struct atomic_shared
+		{
+			explicit atomic_shared(shared<T> p) : value(std::move(p)) {}
+
+			shared<T> load() const
+			{
+				return std::atomic_load(&value);
+			}
+
+			shared<T> value;
+		};
+
+		template<typename T, typename... Args>
+		static shared<T> make_shared(Args&&... args)
+		{
+			return std::make_shared<T>(std::forward<Args>(args)...);
+		}
+
+		template<typename T, typename... Args>
+		static unique<T> make_unique(Args&&... args)
+		{
+			return std::make_unique<T>(std::forward<Args>(args)...);
+		}
+
+		// the standard library has no layout option: counts always share a line with the object
+		template<typename T, typename... Args>
+		static shared<T> make_shared_separate(Args&&... args)
+		{
+			return std::make_shared<T>(std::forward<Args>(args)...);
+		}
+
+		// nor a background reclaimer: teardown always runs on the releasing thread
+		template<typename T, typename... Args>
+		static shared<T> make_shared_deferred(Args&&... args)
+		{
+			return std::make_shared<T>(std::forward<Args>(args)...);
+		}
+
+		static void* block_allocate(std::size_t size)
+		{
+			return ::operator new(size);
+		}
+
+		static void block_deallocate(void* p, std::size_t size) noexcept
+		{
+			::operator delete(p, size);
+		}
+
+		// nor biased or sharded counting: every copy hits the one count
+		template<typename T, typename... Args>
+		static shared<T> make_shared_biased(Args&&... args)
+		{
+			return std::make_shared<T>(std::forward<Args>(args)...);
+		}
+
+		template<typename T, typename... Args>
+		static shared<T> make_shared_sharded(Args&&... args)
+		{
+			return std::make_shared<T>(std::forward<Args>(args)...);
+		}
+
+		static void drain() {}
+
+		// read-mostly object read through a shared_ptr copy
+		template<typename T>
+		struct read_mostly
+		{
+			explicit read_mostly(shared<T> p) : value(std::move(p)) {}
+
+			template<typename F>
+			void read(F const& f) const
+			{
+				shared<T> copy(value);
+				f(*copy);
+			}
+
+			shared<T> value;
+		};
+
+		template<typename T, typename U>
+		static shared<T> static_cast_(shared<U> const& r)
+		{
+			return std::static_pointer_cast<T>(r);
+		}
+
+		template<typename T, typename U>
+		static shared<T> dynamic_cast_(shared<U> const& r)
+		{
+			return std::dynamic_pointer_cast<T>(r);
+		}
+
+		template<typename T>
+		static void fan_out(shared<T> const& p, std::size_t n, std::vector<shared<T>>& out)
+		{
+			for (; n != 0; --n)
+			{
+				out.push_back(p);
+			}
+		}
+
+		template<typename T>
+		static void drop_all(std::vector<shared<T>>& v)
+		{
+			v.clear();
+		}
+	};
+
+	//-------------------runner---------------------------------
+	struct bench_result
+	{
+		double ns_per_op;
+		double allocs_per_op;
+	};
+
+	// keeps the optimiser from dropping the measured work. The measured loops add to
+	// their own thread's sink and run() publishes it once the thread is done, so the
+	// sink never puts a shared cache line into the numbers.
+	std::atomic<long> g_sink{0};
+	thread_local long t_sink = 0;
+
+	inline void sink(long v)
+	{
+		t_sink += v;
+	}
+
+	// body(iterations) runs on every thread at once; all threads start together
+	template<typename Body>
+	bench_result run(unsigned threads, std::size_t iterations, Body const& body)
+	{
+		std::atomic<unsigned> ready{0};
+		std::atomic<bool> go{false};
+		std::atomic<std::size_t> allocs{0};
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < threads; ++t)
+		{
+			workers.emplace_back([&]
+				{
+					ready.fetch_add(1);
+					while (!go.load(std::memory_order_acquire))
+					{
+						std::this_thread::yield();
+					}
+					std::size_t before = t_allocs;
+					body(iterations);
+					allocs.fetch_add(t_allocs - before);
+					g_sink.fetch_add(t_sink, std::memory_order_relaxed);
+				});
+		}
+		while (ready.load() != threads)
+		{
+			std::this_thread::yield();
+		}
+		auto start = std::chrono::steady_clock::now();
+		go.store(true, std::memory_order_release);
+		for (std::thread& w : workers)
+		{
+			w.join();
+		}
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		double ops = static_cast<double>(iterations) * threads;
+		// wall time per operation of one thread, so flat numbers mean perfect scaling
+		return { ns / static_cast<double>(iterations), static_cast<double>(allocs.load()) / ops };
+	}
+
+	//-------------------cases---------------------------------
+	template<typename Lib>
+	bench_result make_shared_case(unsigned threads, std::size_t n)
+	{
+		return run(threads, n, [](std::size_t iterations)
+			{
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					auto p = Lib::template make_shared<long>(static_cast<long>(i));
+					sink(*p & 1);
+				}
+			});
+	}
+
+	template<typename Lib>
+	bench_result adopt_case(unsigned threads, std::size_t n)
+	{
+		return run(threads, n, [](std::size_t iterations)
+			{
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					typename Lib::template shared<long> p(new long(static_cast<long>(i)));
+					sink(*p & 1);
+				}
+			});
+	}
+
+	// hands the control blocks of adopted pointers to sp_counted_pool
+	template<typename T>
+	struct pool_allocator
+	{
+		typedef T value_type;
+
+		pool_allocator() = default;
+
+		template<typename U>
+		pool_allocator(pool_allocator<U> const&) noexcept {}
+
+		T* allocate(std::size_t n)
+		{
+			return static_cast<T*>(utils::sp::sp_counted_pool::allocate(n * sizeof(T)));
+		}
+
+		void deallocate(T* p, std::size_t n) noexcept
+		{
+			utils::sp::sp_counted_pool::deallocate(p, n * sizeof(T));
+		}
+
+		template<typename U>
+		bool operator==(pool_allocator<U> const&) const noexcept
+		{
+			return true;
+		}
+
+		template<typename U>
+		bool operator!=(pool_allocator<U> const&) const noexcept
+		{
+			return false;
+		}
+	};
+
+	// adopt_case with the control block from sp_counted_pool, for both libraries
+	template<typename Lib>
+	bench_result adopt_pooled_case(unsigned threads, std::size_t n)
+	{
+		return run(threads, n, [](std::size_t iterations)
+			{
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					typename Lib::template shared<long> p(new long(static_cast<long>(i)), std::default_delete<long>(), pool_allocator<long>());
+					sink(*p & 1);
+				}
+			});
+	}
+
+	// control-block sized allocations in bursts, as adopting raw pointers makes them:
+	// sp_counted_pool (sp) against the global heap (std). 1e9 / ns is blocks per second.
+	template<typename Lib>
+	bench_result pool_block_case(unsigned threads, std::size_t n)
+	{
+		constexpr std::size_t burst = 64;
+		constexpr std::size_t size = sizeof(utils::sp::sp_counted_impl_p<long>);
+		return run(threads, n, [](std::size_t iterations)
+			{
+				void* blocks[burst];
+				for (std::size_t i = 0; i < iterations; i += burst)
+				{
+					for (void*& b : blocks)
+					{
+						b = Lib::block_allocate(size);
+					}
+					for (void* b : blocks)
+					{
+						Lib::block_deallocate(b, size);
+					}
+				}
+			});
+	}
+
+	// every thread copies the same object: the count is the contended cache line,
+	// unless the sharded block spreads it over per-thread slots
+	template<typename Lib, bool Sharded = false>
+	bench_result copy_case(unsigned threads, std::size_t n)
+	{
+		auto shared = Sharded ? Lib::template make_shared_sharded<long>(1) : Lib::template make_shared<long>(1);
+		return run(threads, n, [&shared](std::size_t iterations)
+			{
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					typename Lib::template shared<long> c(shared);
+					sink(*c & 1);
+				}
+			});
+	}
+
+	constexpr std::size_t fan_out_width = 32;
+
+	// every thread loads the same published pointer: reader scaling of atomic_shared_ptr
+	template<typename Lib>
+	bench_result atomic_load_case(unsigned threads, std::size_t n)
+	{
+		typename Lib::template atomic_shared<long> published(Lib::template make_shared<long>(1));
+		return run(threads, n, [&published](std::size_t iterations)
+			{
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					auto p = published.load();
+					sink(*p & 1);
+				}
+			});
+	}
+
+	// every thread reads the same object: guarded view (sp) against shared_ptr copy (std)
+	template<typename Lib>
+	bench_result guarded_read_case(unsigned threads, std::size_t n)
+	{
+		bench_result r;
+		{
+			typename Lib::template read_mostly<long> object(Lib::template make_shared<long>(1));
+			r = run(threads, n, [&object](std::size_t iterations)
+				{
+					for (std::size_t i = 0; i < iterations; ++i)
+					{
+						object.read([](long v)
+							{
+								sink(v & 1);
+							});
+					}
+				});
+		}
+		Lib::drain();
+		return r;
+	}
+
+	// each thread mostly copies an object it created itself; every 16th copy is of
+	// one created by another thread
+	template<typename Lib>
+	bench_result mostly_owner_case(unsigned threads, std::size_t n)
+	{
+		auto foreign = Lib::template make_shared_biased<long>(1);
+		return run(threads, n, [&foreign](std::size_t iterations)
+			{
+				auto own = Lib::template make_shared_biased<long>(1);
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					typename Lib::template shared<long> c(i % 16 == 0 ? foreign : own);
+					sink(*c & 1);
+				}
+			});
+	}
+
+	// one message handed to fan_out_width subscribers, then dropped by all of them
+	template<typename Lib>
+	bench_result fan_out_case(unsigned threads, std::size_t n)
+	{
+		auto shared = Lib::template make_shared<long>(1);
+		return run(threads, n, [&shared](std::size_t iterations)
+			{
+				std::vector<typename Lib::template shared<long>> subscribers;
+				subscribers.reserve(fan_out_width);
+				for (std::size_t i = 0; i < iterations; i += fan_out_width)
+				{
+					Lib::fan_out(shared, fan_out_width, subscribers);
+					sink(*subscribers.back() & 1);
+					Lib::drop_all(subscribers);
+				}
+			});
+	}
+
+	template<typename Lib>
+	bench_result move_case(unsigned threads, std::size_t n)
+	{
+		return run(threads, n, [](std::size_t iterations)
+			{
+				auto a = Lib::template make_shared<long>(1);
+				typename Lib::template shared<long> b;
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					b = std::move(a);
+					a = std::move(b);
+				}
+				sink(*a);
+			});
+	}
+
+	template<typename Lib>
+	bench_result weak_lock_case(unsigned threads, std::size_t n)
+	{
+		auto shared = Lib::template make_shared<long>(1);
+		typename Lib::template weak<long> weak(shared);
+		return run(threads, n, [&weak](std::size_t iterations)
+			{
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					auto l = weak.lock();
+					sink(*l & 1);
+				}
+			});
+	}
+
+	template<typename Lib>
+	bench_result static_cast_case(unsigned threads, std::size_t n)
+	{
+		typename Lib::template shared<base_object> shared = Lib::template make_shared<derived_object>();
+		return run(threads, n, [&shared](std::size_t iterations)
+			{
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					auto d = Lib::template static_cast_<derived_object>(shared);
+					sink(d->extra & 1);
+				}
+			});
+	}
+
+	template<typename Lib>
+	bench_result dynamic_cast_case(unsigned threads, std::size_t n)
+	{
+		typename Lib::template shared<base_object> shared = Lib::template make_shared<derived_object>();
+		return run(threads, n, [&shared](std::size_t iterations)
+			{
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					auto d = Lib::template dynamic_cast_<derived_object>(shared);
+					sink(d->extra & 1);
+				}
+			});
+	}
+
+	template<typename Lib>
+	bench_result make_unique_case(unsigned threads, std::size_t n)
+	{
+		return run(threads, n, [](std::size_t iterations)
+			{
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					auto p = Lib::template make_unique<long>(static_cast<long>(i));
+					sink(*p & 1);
+				}
+			});
+	}
+
+	template<typename Lib>
+	bench_result unique_move_case(unsigned threads, std::size_t n)
+	{
+		return run(threads, n, [](std::size_t iterations)
+			{
+				auto a = Lib::template make_unique<long>(1);
+				typename Lib::template unique<long> b;
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					b = std::move(a);
+					a = std::move(b);
+				}
+				sink(*a);
+			});
+	}
+
+	//-------------------lock against release---------------------------------
+	struct tracked_object
+	{
+		static constexpr long alive = 0x5a5a5a5a;
+
+		~tracked_object()
+		{
+			state = 0;
+		}
+
+		long state = alive;
+	};
+
+	struct spin_barrier
+	{
+		explicit spin_barrier(unsigned n) : count(n) {}
+
+		void wait()
+		{
+			unsigned gen = generation.load(std::memory_order_acquire);
+			if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == count)
+			{
+				arrived.store(0, std::memory_order_relaxed);
+				generation.fetch_add(1, std::memory_order_release);
+				return;
+			}
+			while (generation.load(std::memory_order_acquire) == gen)
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		unsigned count;
+		std::atomic<unsigned> arrived{ 0 };
+		std::atomic<unsigned> generation{ 0 };
+	};
+
+	// set when a lock succeeded on an object that was already destroyed
+	std::atomic<std::size_t> g_resurrected{ 0 };
+
+	// One extra thread drops the only owners of a batch of objects while the measured
+	// threads lock them through weak_ptrs. The make_shared blocks outlive their objects,
+	// so a lock that wrongly succeeds reads the destroyed state instead of crashing.
+	template<typename Lib>
+	bench_result lock_release_case(unsigned threads, std::size_t n)
+	{
+		constexpr std::size_t batch = 64;
+		std::size_t rounds = n / batch > 0 ? n / batch : 1;
+		std::vector<typename Lib::template shared<tracked_object>> owners(batch);
+		std::vector<typename Lib::template weak<tracked_object>> weaks(batch);
+		spin_barrier barrier(threads + 1);
+		std::atomic<std::size_t> allocs{ 0 };
+
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < threads; ++t)
+		{
+			workers.emplace_back([&]
+				{
+					std::size_t before = t_allocs;
+					for (std::size_t r = 0; r < rounds; ++r)
+					{
+						barrier.wait();
+						for (std::size_t i = 0; i < batch; ++i)
+						{
+							auto l = weaks[i].lock();
+							if (l && l->state != tracked_object::alive)
+							{
+								g_resurrected.fetch_add(1, std::memory_order_relaxed);
+							}
+						}
+						barrier.wait();
+					}
+					allocs.fetch_add(t_allocs - before);
+				});
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		for (std::size_t r = 0; r < rounds; ++r)
+		{
+			for (std::size_t i = 0; i < batch; ++i)
+			{
+				owners[i] = Lib::template make_shared<tracked_object>();
+				weaks[i] = owners[i];
+			}
+			barrier.wait();
+			for (std::size_t i = 0; i < batch; ++i)
+			{
+				owners[i].reset();
+			}
+			barrier.wait();
+		}
+		for (std::thread& w : workers)
+		{
+			w.join();
+		}
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		double ops = static_cast<double>(rounds * batch);
+		return { ns / ops, static_cast<double>(allocs.load()) / (ops * threads) };
+	}
+
+	struct written_object
+	{
+		std::atomic<long> value{ 0 };
+	};
+
+	// One writer updates a field of the object while `threads` other threads copy
+	// shared_ptrs to it; the time is the writer's per write. With the packed layout
+	// every copy steals the line the writer is storing to.
+	template<typename Lib, bool Separate>
+	bench_result writer_copiers_case(unsigned threads, std::size_t n)
+	{
+		auto shared = Separate ? Lib::template make_shared_separate<written_object>() : Lib::template make_shared<written_object>();
+		std::atomic<unsigned> ready{ 0 };
+		std::atomic<bool> stop{ false };
+		std::vector<std::thread> copiers;
+		for (unsigned t = 0; t < threads; ++t)
+		{
+			copiers.emplace_back([&]
+				{
+					ready.fetch_add(1);
+					while (!stop.load(std::memory_order_relaxed))
+					{
+						typename Lib::template shared<written_object> c(shared);
+					}
+				});
+		}
+		while (ready.load() != threads)
+		{
+			std::this_thread::yield();
+		}
+
+		std::size_t before = t_allocs;
+		written_object* w = shared.get();
+		auto start = std::chrono::steady_clock::now();
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			w->value.store(w->value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		std::size_t allocs = t_allocs - before;
+		stop.store(true);
+		for (std::thread& c : copiers)
+		{
+			c.join();
+		}
+		g_sink.fetch_add(w->value.load() & 1, std::memory_order_relaxed);
+		return { ns / static_cast<double>(n), static_cast<double>(allocs) / static_cast<double>(n) };
+	}
+
+	//-------------------deferred against inline release---------------------------------
+	constexpr std::size_t graph_size = 256;
+
+	template<typename Lib>
+	struct object_graph
+	{
+		std::vector<typename Lib::template shared<long>> nodes;
+	};
+
+	// The last owner of an object graph drops it and only the drop is timed: the
+	// latency a releasing thread sees. Deferred graphs are torn down on the
+	// reclaimer thread instead.
+	template<typename Lib, bool Deferred>
+	bench_result drop_graph_case(unsigned threads, std::size_t n)
+	{
+		typedef object_graph<Lib> graph;
+		std::size_t rounds = n / graph_size > 0 ? n / graph_size : 1;
+		std::atomic<double> dropping_ns{ 0 };
+		bench_result r = run(threads, rounds, [&dropping_ns](std::size_t iterations)
+			{
+				double ns = 0;
+				for (std::size_t i = 0; i < iterations; ++i)
+				{
+					auto g = Deferred ? Lib::template make_shared_deferred<graph>() : Lib::template make_shared<graph>();
+					g->nodes.reserve(graph_size);
+					for (std::size_t k = 0; k < graph_size; ++k)
+					{
+						g->nodes.push_back(Lib::template make_shared<long>(static_cast<long>(k)));
+					}
+					auto start = std::chrono::steady_clock::now();
+					g.reset();
+					ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+				}
+				double seen = dropping_ns.load(std::memory_order_relaxed);
+				while (!dropping_ns.compare_exchange_weak(seen, seen + ns, std::memory_order_relaxed))
+				{
+				}
+			});
+		Lib::drain();
+		r.ns_per_op = dropping_ns.load() / static_cast<double>(rounds * threads);
+		return r;
+	}
+
+	//-------------------stress checks---------------------------------
+	// Correctness under contention rather than speed, best built with
+	// -fsanitize=thread or -fsanitize=address. Each check counts what it sees go
+	// wrong; main fails if any did.
+	std::atomic<std::size_t> g_check_failures{ 0 };
+
+	void expect(bool ok, const char* what)
+	{
+		if (!ok)
+		{
+			g_check_failures.fetch_add(1, std::memory_order_relaxed);
+			std::printf("check failed: %s\n", what);
+		}
+	}
+
+	struct counted_object
+	{
+		static constexpr long alive = 0x5a5a5a5a;
+		static std::atomic<long> live;
+
+		counted_object()
+		{
+			live.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		counted_object(counted_object const&) = delete;
+
+		~counted_object()
+		{
+			state = 0;
+			live.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		long state = alive;
+	};
+
+	std::atomic<long> counted_object::live{ 0 };
+
+	// two writers keep replacing the published object while readers load it
+	void atomic_store_load_check(std::size_t n)
+	{
+		constexpr unsigned writers = 2;
+		constexpr unsigned readers = 6;
+		{
+			utils::sp::atomic_shared_ptr<counted_object> slot(utils::sp::make_shared<counted_object>());
+			std::atomic<bool> stop{ false };
+			std::atomic<std::size_t> dead{ 0 };
+			std::vector<std::thread> reader_threads;
+			for (unsigned t = 0; t < readers; ++t)
+			{
+				reader_threads.emplace_back([&]
+					{
+						while (!stop.load(std::memory_order_relaxed))
+						{
+							auto p = slot.load();
+							if (!p || p->state != counted_object::alive)
+							{
+								dead.fetch_add(1, std::memory_order_relaxed);
+							}
+						}
+					});
+			}
+			std::vector<std::thread> writer_threads;
+			for (unsigned t = 0; t < writers; ++t)
+			{
+				writer_threads.emplace_back([&]
+					{
+						for (std::size_t i = 0; i < n; ++i)
+						{
+							if (i % 4 == 0)
+							{
+								auto expected = slot.load();
+								slot.compare_exchange_strong(expected, utils::sp::make_shared<counted_object>());
+							}
+							else if (i % 4 == 1)
+							{
+								slot.exchange(utils::sp::make_shared<counted_object>());
+							}
+							else
+							{
+								slot.store(utils::sp::make_shared<counted_object>());
+							}
+						}
+					});
+			}
+			for (std::thread& w : writer_threads)
+			{
+				w.join();
+			}
+			stop.store(true);
+			for (std::thread& r : reader_threads)
+			{
+				r.join();
+			}
+			expect(dead.load() == 0, "atomic_shared_ptr::load returned a destroyed object");
+		}
+		expect(counted_object::live.load() == 0, "atomic_shared_ptr leaked or double-freed objects");
+	}
+
+	// Each round, every thread gets its own owner of a fresh object. They copy and drop it
+	// and lock a weak_ptr to it while the others drop their owners, so the last release
+	// (and its single-RMW fast path) races with copies and locks on other threads.
+	void copy_release_lock_check(unsigned threads, std::size_t n)
+	{
+		constexpr std::size_t burst = 64;
+		std::size_t rounds = n / burst > 0 ? n / burst : 1;
+		std::vector<utils::sp::shared_ptr<counted_object>> owners(threads);
+		std::vector<utils::sp::weak_ptr<counted_object>> weaks(threads);
+		spin_barrier barrier(threads + 1);
+		std::atomic<std::size_t> dead{ 0 };
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < threads; ++t)
+		{
+			workers.emplace_back([&, t]
+				{
+					for (std::size_t r = 0; r < rounds; ++r)
+					{
+						barrier.wait();
+						for (std::size_t i = 0; i < burst; ++i)
+						{
+							utils::sp::shared_ptr<counted_object> copy(owners[t]);
+							auto locked = weaks[t].lock();
+							if (copy->state != counted_object::alive || (locked && locked->state != counted_object::alive))
+							{
+								dead.fetch_add(1, std::memory_order_relaxed);
+							}
+						}
+						owners[t].reset();
+						for (std::size_t i = 0; i < burst; ++i)
+						{
+							auto locked = weaks[t].lock();
+							if (locked && locked->state != counted_object::alive)
+							{
+								dead.fetch_add(1, std::memory_order_relaxed);
+							}
+						}
+						weaks[t].reset();
+						barrier.wait();
+					}
+				});
+		}
+		std::size_t leaked = 0;
+		for (std::size_t r = 0; r < rounds; ++r)
+		{
+			{
+				auto object = utils::sp::make_shared<counted_object>();
+				for (unsigned t = 0; t < threads; ++t)
+				{
+					owners[t] = object;
+					weaks[t] = object;
+				}
+			}
+			barrier.wait();
+			barrier.wait();
+			leaked += counted_object::live.load() != 0 ? 1 : 0;
+		}
+		for (std::thread& w : workers)
+		{
+			w.join();
+		}
+		expect(dead.load() == 0, "a copy or weak_ptr::lock saw a destroyed object");
+		expect(leaked == 0, "an object outlived its last owner");
+	}
+
+	// Each round the creator hands the only reference to a releaser thread, which copies
+	// and drops it while the lockers lock a weak_ptr to it, so the last release races
+	// with their locks. Once every reference is gone no lock may succeed, and after the
+	// creator's flush (biased blocks merge there) the object must be destroyed while the
+	// weak_ptr still holds the block. With creator_exits every object comes from a
+	// thread that ends before the handoff.
+	template<typename Make>
+	void handoff_lock_check(const char* name, Make make, bool creator_exits, std::size_t n)
+	{
+		constexpr unsigned lockers = 3;
+		std::size_t rounds = n / 64 > 0 ? n / 64 : 1;
+		utils::sp::shared_ptr<counted_object> handed;
+		utils::sp::weak_ptr<counted_object> weak;
+		std::atomic<bool> released{ false };
+		std::atomic<std::size_t> dead{ 0 };
+		std::atomic<std::size_t> revived{ 0 };
+		spin_barrier barrier(lockers + 2);
+		auto expect_gone = [&]
+			{
+				if (weak.lock() || !weak.expired())
+				{
+					revived.fetch_add(1, std::memory_order_relaxed);
+				}
+			};
+
+		std::vector<std::thread> threads;
+		threads.emplace_back([&]
+			{
+				for (std::size_t r = 0; r < rounds; ++r)
+				{
+					barrier.wait();
+					{
+						utils::sp::shared_ptr<counted_object> mine = std::move(handed);
+						for (int i = 0; i < 8; ++i)
+						{
+							utils::sp::shared_ptr<counted_object> copy(mine);
+							if (copy->state != counted_object::alive)
+							{
+								dead.fetch_add(1, std::memory_order_relaxed);
+							}
+						}
+					}
+					released.store(true, std::memory_order_release);
+					barrier.wait();
+					expect_gone();
+					barrier.wait();
+				}
+			});
+		for (unsigned t = 0; t < lockers; ++t)
+		{
+			threads.emplace_back([&]
+				{
+					for (std::size_t r = 0; r < rounds; ++r)
+					{
+						barrier.wait();
+						while (!released.load(std::memory_order_acquire))
+						{
+							auto locked = weak.lock();
+							if (locked && locked->state != counted_object::alive)
+							{
+								dead.fetch_add(1, std::memory_order_relaxed);
+							}
+						}
+						barrier.wait();
+						expect_gone();
+						barrier.wait();
+					}
+				});
+		}
+
+		std::size_t leaked = 0;
+		for (std::size_t r = 0; r < rounds; ++r)
+		{
+			if (creator_exits)
+			{
+				std::thread([&] { handed = make(); }).join();
+			}
+			else
+			{
+				handed = make();
+			}
+			weak = handed;
+			released.store(false, std::memory_order_relaxed);
+			barrier.wait();
+			barrier.wait();
+			expect_gone();
+			barrier.wait();
+			utils::sp::sp_counted_biased::flush();
+			leaked += counted_object::live.load() != 0 ? 1 : 0;
+			// the weak_ptr outlived every strong reference; it frees the block now
+			weak.reset();
+		}
+		for (std::thread& t : threads)
+		{
+			t.join();
+		}
+		expect(dead.load() == 0, (std::string(name) + ": a copy or lock saw a destroyed object").c_str());
+		expect(revived.load() == 0, (std::string(name) + ": weak_ptr::lock revived an object after its last release").c_str());
+		expect(leaked == 0, (std::string(name) + ": an object outlived its last owner").c_str());
+	}
+
+	// members from namespace std bring std::make_shared into overload resolution through ADL
+	void make_shared_tuple_check()
+	{
+		auto parts = utils::sp::make_shared_tuple<int, std::string>(1, std::string("x"));
+		auto& number = std::get<0>(parts);
+		auto& text = std::get<1>(parts);
+		expect(*number == 1 && *text == "x", "make_shared_tuple built the wrong values");
+		expect(number.use_count() == 2 && text.use_count() == 2, "make_shared_tuple parts do not share one block");
+	}
+
+	void run_checks(std::size_t iterations)
+	{
+		std::size_t n = iterations / 10 > 0 ? iterations / 10 : 1;
+		copy_release_lock_check(4, n);
+		atomic_store_load_check(n);
+		handoff_lock_check("biased", [] { return utils::sp::make_shared_biased<counted_object>(); }, false, n);
+		handoff_lock_check("biased, creator exits", [] { return utils::sp::make_shared_biased<counted_object>(); }, true, n);
+		handoff_lock_check("sharded", [] { return utils::sp::make_shared_sharded<counted_object>(); }, false, n);
+		handoff_lock_check("sharded, creator exits", [] { return utils::sp::make_shared_sharded<counted_object>(); }, true, n);
+		make_shared_tuple_check();
+	}
+
+	//-------------------report---------------------------------
+	typedef bench_result (*case_fn)(unsigned, std::size_t);
+
+	struct bench_case
+	{
+		const char* name;
+		case_fn sp;
+		case_fn std;
+	};
+
+	void print_row(const char* name, unsigned threads, bench_result const& sp, bench_result const& std_)
+	{
+		std::printf("%-16s %7u %12.2f %12.2f %8.2fx %10.2f %10.2f\n",
+			name, threads, sp.ns_per_op, std_.ns_per_op,
+			std_.ns_per_op > 0 ? sp.ns_per_op / std_.ns_per_op : 0.0,
+			sp.allocs_per_op, std_.allocs_per_op);
+	}
+
+	// 1, 2, 4 .. and always finish on max itself
+	unsigned next_thread_count(unsigned threads, unsigned max_threads)
+	{
+		if (threads < max_threads && threads * 2 > max_threads)
+		{
+			return max_threads;
+		}
+		return threads * 2;
+	}
+
+	void print_sizes()
+	{
+		std::printf("%-40s %10s %10s\n", "size (bytes)", "utils::sp", "std");
+		std::printf("%-40s %10zu %10zu\n", "shared_ptr<long>", sizeof(utils::sp::shared_ptr<long>), sizeof(std::shared_ptr<long>));
+		std::printf("%-40s %10zu %10zu\n", "weak_ptr<long>", sizeof(utils::sp::weak_ptr<long>), sizeof(std::weak_ptr<long>));
+		std::printf("%-40s %10zu %10zu\n", "unique_ptr<long>", sizeof(utils::sp::unique_ptr<long>), sizeof(std::unique_ptr<long>));
+		std::printf("%-40s %10zu %10zu\n", "unique_ptr<long[]>", sizeof(utils::sp::unique_ptr<long[]>), sizeof(std::unique_ptr<long[]>));
+		std::printf("%-40s %10zu %10s\n", "control block, make_shared<long>", sizeof(utils::sp::sp_counted_impl_pdi<long>), "-");
+		std::printf("%-40s %10zu %10s\n", "control block, shared_ptr<long>(new)", sizeof(utils::sp::sp_counted_impl_p<long>), "-");
+		std::printf("\n");
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+	unsigned max_threads = argc > 2 ? static_cast<unsigned>(std::strtoul(argv[2], nullptr, 10)) : std::thread::hardware_concurrency();
+	if (max_threads == 0)
+	{
+		max_threads = 1;
+	}
+
+	bench_case const cases[] = {
+		{ "make_shared", make_shared_case<sp_lib>, make_shared_case<std_lib> },
+		{ "adopt new", adopt_case<sp_lib>, adopt_case<std_lib> },
+		{ "adopt new (pool)", adopt_pooled_case<sp_lib>, adopt_pooled_case<std_lib> },
+		{ "pool block", pool_block_case<sp_lib>, pool_block_case<std_lib> },
+		{ "copy", copy_case<sp_lib>, copy_case<std_lib> },
+		{ "copy sharded", copy_case<sp_lib, true>, copy_case<std_lib, true> },
+		{ "fan-out", fan_out_case<sp_lib>, fan_out_case<std_lib> },
+		{ "atomic load", atomic_load_case<sp_lib>, atomic_load_case<std_lib> },
+		{ "guarded read", guarded_read_case<sp_lib>, guarded_read_case<std_lib> },
+		{ "mostly owner", mostly_owner_case<sp_lib>, mostly_owner_case<std_lib> },
+		{ "move", move_case<sp_lib>, move_case<std_lib> },
+		{ "weak lock", weak_lock_case<sp_lib>, weak_lock_case<std_lib> },
+		{ "static cast", static_cast_case<sp_lib>, static_cast_case<std_lib> },
+		{ "dynamic cast", dynamic_cast_case<sp_lib>, dynamic_cast_case<std_lib> },
+		{ "make_unique", make_unique_case<sp_lib>, make_unique_case<std_lib> },
+		{ "unique move", unique_move_case<sp_lib>, unique_move_case<std_lib> },
+		{ "lock vs release", lock_release_case<sp_lib>, lock_release_case<std_lib> },
+		{ "drop graph", drop_graph_case<sp_lib, false>, drop_graph_case<std_lib, false> },
+		{ "drop deferred", drop_graph_case<sp_lib, true>, drop_graph_case<std_lib, true> },
+		{ "1w/Nc packed", writer_copiers_case<sp_lib, false>, writer_copiers_case<std_lib, false> },
+		{ "1w/Nc separate", writer_copiers_case<sp_lib, true>, writer_copiers_case<std_lib, true> },
+	};
+
+	run_checks(iterations);
+	print_sizes();
+	std::printf("%-16s %7s %12s %12s %9s %10s %10s\n", "case", "threads", "sp ns/op", "std ns/op", "sp/std", "sp alloc", "std alloc");
+	for (bench_case const& c : cases)
+	{
+		for (unsigned threads = 1; threads <= max_threads; threads = next_thread_count(threads, max_threads))
+		{
+			print_row(c.name, threads, c.sp(threads, iterations), c.std(threads, iterations));
+		}
+	}
+	if (g_resurrected.load() != 0)
+	{
+		std::printf("FAILED: weak_ptr::lock returned %zu destroyed objects\n", g_resurrected.load());
+		return 1;
+	}
+	if (g_check_failures.load() != 0)
+	{
+		std::printf("FAILED: %zu stress checks\n", g_check_failures.load());
+		return 1;
+	}
+	return g_sink.load() == -1 ? 1 : 0;
+}